@@ -1,15 +1,34 @@
+#define _POSIX_C_SOURCE 200809L /* kill, rand_r and clock_gettime */
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
 
 // To be submitted as a single file, there was no header file (this is something I know how to do however, in addition to a Makefile)
 /*-------------------------------------------------------------------*/
 /* HEADER DECLARATIONS */
 
-#define BOARD_SIZE 8       /* board size */
-#define ROWS_WITH_PIECES 3 /* number of initial rows with pieces */
+/* The board geometry is fixed when compiling, so every loop and table below
+is sized for one board. Build "gcc -O2 -o checkersbot checkersbot.c -lm
+-lpthread" for 8x8 and add -DBOARD_SIZE=10 (naming it checkersbot10) for
+10x10; "-b 10" on the 8x8 binary runs the 10x10 one */
+#define DEFAULT_BOARD_SIZE 8 /* the build without a size suffix */
+#ifndef BOARD_SIZE
+#define BOARD_SIZE DEFAULT_BOARD_SIZE /* board size */
+#endif
+#define ROWS_WITH_PIECES ((BOARD_SIZE - 2) / 2) /* initial rows with pieces */
 #define CELL_EMPTY '.'     /* empty cell character */
 #define CELL_BPIECE 'b'    /* black piece character */
 #define CELL_WPIECE 'w'    /* white piece character */
@@ -21,10 +40,34 @@
 #define COMP_ACTIONS 10    /* number of computed actions */
 
 /* strings required when printing the board */
+#if BOARD_SIZE == 8
 #define ROW_SEPERATOR "   +---+---+---+---+---+---+---+---+\n"
-#define MOVE_SEPERATOR "=====================================\n"
-#define TEAM_PIECES 12
 #define COLUMNS "     A   B   C   D   E   F   G   H\n"
+#elif BOARD_SIZE == 10
+#define ROW_SEPERATOR "   +---+---+---+---+---+---+---+---+---+---+\n"
+#define COLUMNS "     A   B   C   D   E   F   G   H   I   J\n"
+#else
+#error "BOARD_SIZE must be 8 or 10"
+#endif
+
+/* the bitboard kernel kept alongside every searched board: one bit per
+dark square, so 8x8 works on 32-bit words and 10x10 on 64-bit ones. Move
+generation walks the side to move's bits and the evaluation is popcounts */
+#if BOARD_SIZE == 8
+typedef uint32_t bitboard_t;
+#define POPCOUNT(bits) __builtin_popcount(bits)
+#define LOWEST_BIT(bits) __builtin_ctz(bits)
+typedef signed char feature_t;
+#else
+typedef uint64_t bitboard_t;
+#define POPCOUNT(bits) __builtin_popcountll(bits)
+#define LOWEST_BIT(bits) __builtin_ctzll(bits)
+typedef short feature_t;
+#endif
+#define DARK_SQUARES (BOARD_SIZE * BOARD_SIZE / 2) /* bits in a bitboard */
+#define HALF_ROW (BOARD_SIZE / 2) /* dark squares in one row */
+#define MOVE_SEPERATOR "=====================================\n"
+#define TEAM_PIECES (ROWS_WITH_PIECES * BOARD_SIZE / 2)
 #define PROGRAM_MOVE "*** "
 
 #define SENTINEL -1          /* returned if piece is outside of the board */
@@ -49,13 +92,136 @@
 #define DIRECTION_DISTANCE 2 /* The distance between directional tests */
 #define CHECK_OVER 1         /* For checking if the game is over */
 #define NO_OPTIONS 0         /* For when node is indicative of game over */
+#define MAX_HOPS TEAM_PIECES /* most landing squares inside one move */
+#define MAX_OPTIONS 128      /* most moves generated for one board */
+#define CELL_CAPTURED 'x'    /* marks a piece already jumped in a chain */
+#define MOVE_TEXT_LEN (4 * (MAX_HOPS + 2)) /* longest printed move */
+#define RULES_DEFAULT 0      /* one jump per action, captures optional */
+#define RULE_CHAINS 1        /* a capture continues while it can jump */
+#define RULE_FORCED 2        /* a capture must be played if available */
+
+/* evaluation features, each counted as black's total minus white's */
+#define EVAL_FEATURES 6      /* number of weighted evaluation features */
+#define FEAT_PIECE 0         /* pieces on the board */
+#define FEAT_TOWER 1         /* towers on the board */
+#define FEAT_ADVANCE 2       /* rows each piece has advanced from home */
+#define FEAT_BACK_RANK 3     /* pieces still guarding the home row */
+#define FEAT_CENTRE 4        /* pieces/towers inside the centre square */
+#define FEAT_TOWER_MOBILITY 5 /* empty cells diagonally next to towers */
+#define CENTRE_MARGIN ((BOARD_SIZE - 4) / 2) /* rows/columns outside centre */
+#define MAX_LINE_LEN 256     /* longest line read from a text input file */
+#define PATH_LEN 4096        /* longest program path started by -b */
+#define INT_TEXT_LEN 12      /* longest printed int, with its terminator */
+
+/* search and transposition table */
+#define NO_MOVE -1           /* no option has been chosen */
+#define NO_BEST 255          /* table entry without a best option */
+#define TT_BITS 20           /* the table holds 2^TT_BITS entries */
+#define TT_ENTRIES (1 << TT_BITS)
+#define TT_EMPTY 0           /* unused table entry */
+#define TT_EXACT 1           /* stored value is the exact cost */
+#define TT_LOWER 2           /* stored value is a lower bound (cutoff) */
+#define TT_UPPER 3           /* stored value is an upper bound */
+#define PIECE_KINDS 4        /* b, w, B and W */
+#define ZOBRIST_SEED 0x9E3779B97F4A7C15ULL /* seed for the hash keys */
+#define MULTI_PV 3           /* default number of analysed moves */
+#define SQUARES (BOARD_SIZE * BOARD_SIZE) /* cells indexed row major */
+#define KILLER_SLOTS 64      /* killer moves are kept per movenum modulo this */
+#define KILLERS 2            /* killer moves kept per slot */
+#define HISTORY_MAX (1 << 20) /* history scores saturate here */
+#define ORDER_HASH INT_MAX   /* ordering score of the table's best option */
+#define ORDER_CAPTURE (1 << 30) /* ordering score of a capture */
+#define ORDER_KILLER (1 << 29) /* ordering score of a killer move */
+#define LMR_MIN_DEPTH 3      /* shallowest depth where moves are reduced */
+#define LMR_REDUCTION 1      /* plies taken off a reduced move */
+#define TABLE_MAGIC "CKTT"   /* first bytes of a saved table */
+#define TABLE_VERSION 5      /* bumped whenever the saved layout or the
+                                meaning of its pruning settings changes */
+#define FNV_OFFSET 14695981039346656037ULL /* FNV-1a hash parameters */
+#define FNV_PRIME 1099511628211ULL
+
+/* binary game records */
+#define RECORD_MAGIC "CKRB"  /* first bytes of every record file */
+#define RECORD_MAGIC_LEN 4
+#define RECORD_VERSION 1     /* bumped whenever move indices change */
+#define RECORD_ALIGN sizeof(uint64_t) /* the index starts on this boundary */
+#define RESULT_UNKNOWN 0     /* the game stopped before it was over */
+#define RESULT_BLACK 1       /* game_over reported INT_MAX */
+#define RESULT_WHITE 2       /* game_over reported INT_MIN */
+#define RESULT_DRAW 3
+#define RESULT_KINDS 4       /* number of result codes above */
+#define INITIAL_INDEX 1024   /* starting capacity of growable arrays */
+#define INDEX_MAGIC "CKPI"   /* first bytes of a position index */
+#define INDEX_VERSION 1      /* bumped whenever the index layout changes */
+
+/* command line modes and defaults */
+#define MODE_PLAY 0          /* read moves from stdin and play (default) */
+#define MODE_TUNE 1          /* fit the evaluation weights to a corpus */
+#define MODE_MATCH 2         /* play two engine configurations together */
+#define MODE_ANALYSE 3       /* print the best few moves after the input */
+#define MODE_CONVERT 4       /* convert text games into a record file */
+#define MODE_INDEX 5         /* count the positions of a record file */
+#define MODE_TRACE_REPORT 6  /* summarise the slow moves of a trace dump */
+#define DEFAULT_THREADS 4    /* worker threads if the CPU count is unknown */
+#define TUNE_EPOCHS 500      /* default number of tuning iterations */
+#define TUNE_RATE 0.01       /* tuning step size */
+#define TUNE_SIGMOID_K 1.0   /* scales an evaluation into a win chance */
+#define TUNE_WEIGHT_SCALE 100 /* tuned weights are written in 1/100ths */
+#define TUNE_REPORT_EVERY 50 /* epochs between progress lines */
+#define HALF_POINTS 2        /* results are stored as 0/1/2 half points */
+
+/* search tracing */
+#define TRACE_MAGIC "CKTR"   /* first bytes of every dumped slow move */
+#define TRACE_VERSION 1      /* bumped whenever the event layout changes */
+#define TRACE_BITS 18        /* the ring keeps the last 2^TRACE_BITS events */
+#define TRACE_EVENTS (1 << TRACE_BITS)
+#define TRACE_THRESHOLD_MS 100.0 /* default time a move must take to dump */
+#define TRACE_ENTER 0        /* event kinds */
+#define TRACE_EXIT 1
+#define TRACE_TT_HIT 1       /* exit flags: answered by the table */
+#define TRACE_CUTOFF 2       /* an option reached the bound */
+#define TRACE_LEAF 4         /* a leaf or a finished game */
+#define TRACE_CHILDREN 3     /* costliest replies listed under each move */
+#define NS_PER_MS 1000000.0
+#define NS_PER_S 1000000000ULL
+
+/* self-play match settings */
+#define MATCH_GAMES 20000    /* default cap on games if SPRT never stops */
+#define MAX_GAME_PLIES 200   /* a game still running after this is drawn */
+#define OPENING_PLIES 4      /* random plies played to start each game */
+#define MAX_BOOK_LINES 4096  /* most openings read from a book file */
+#define MAX_BOOK_PLIES 32    /* most moves in one book opening */
+#define SPRT_ELO0 0.0        /* default elo difference of the null */
+#define SPRT_ELO1 10.0       /* default elo difference of the alternative */
+#define SPRT_ALPHA 0.05      /* false positive rate */
+#define SPRT_BETA 0.05       /* false negative rate */
+#define CONFIDENCE_Z 1.96    /* z score of the reported 95% error bars */
+#define ELO_SCALE 400.0      /* elo points per factor of ten in odds */
 
 /* Note; board will be traversed in row major order */
 typedef char board_t[BOARD_SIZE][BOARD_SIZE];
+typedef struct
+{
+    /* The dark squares of a board, one bit each; towers are also set in
+    the colour of their side */
+    bitboard_t black, white, towers;
+} packed_board_t;
+
+typedef struct
+{
+    /* Fixed square sets of the bitboard kernel, built once: the square
+    of every bit, and the sets the evaluation counts pieces against */
+    bitboard_t dark, centre, rows[BOARD_SIZE], diagonals[DARK_SQUARES];
+    signed char row[DARK_SQUARES], col[DARK_SQUARES];
+} board_masks_t;
+
 typedef struct
 {
     char sourcecol, sourcerow, targetcol, targetrow;
     int movenum;
+    /* Landing squares between source and target in a chain of captures */
+    int hops;
+    char hopcol[MAX_HOPS], hoprow[MAX_HOPS];
 } move_t;
 
 typedef struct
@@ -63,10 +229,201 @@ typedef struct
     int i, j, addi, addj;
 } direction_t;
 
+typedef struct
+{
+    /* Selective search settings; zero turns each one off */
+    int lmr_moves;       /* quiet moves searched fully before reducing */
+    int futility_margin; /* cost margin for skipping quiet frontier moves */
+} prune_t;
+
+typedef struct
+{
+    /* Settings read from the command line */
+    int mode, threads, epochs, lines, depth, depth_b, games, opening_plies,
+        board_size;
+    prune_t pruning, pruning_b;
+    unsigned int seed;
+    double elo0, elo1;
+    char *weights_file, *weights_file_b, *corpus_file, *output_file,
+        *book_file, *input_file, *records_file, *table_file, *index_file,
+        *trace_file;
+    double trace_threshold;
+} options_t;
+
+typedef struct
+{
+    /* A configuration the search can be switched to between moves */
+    int weights[EVAL_FEATURES], depth;
+    prune_t pruning;
+} engine_t;
+
+typedef struct
+{
+    /* Sent from a match worker to the parent after every game */
+    int game, points;
+} match_result_t;
+
+typedef struct
+{
+    /* One corpus position, reduced to its features and the game result */
+    feature_t features[EVAL_FEATURES];
+    unsigned char result;
+} tune_position_t;
+
+typedef struct
+{
+    /* Every labelled position read for tuning */
+    tune_position_t *positions;
+    int count, size;
+} tune_corpus_t;
+
+typedef struct
+{
+    /* The slice of the corpus a tuning thread sums the gradient over */
+    tune_position_t *positions;
+    int count;
+    double *weights, gradient[EVAL_FEATURES], loss;
+} tune_job_t;
+
+typedef struct
+{
+    /* A stored search result; best is the index of the best option */
+    unsigned long long key;
+    int value;
+    signed char depth;
+    unsigned char flag, best;
+} tt_entry_t;
+
+/* A record file is a header, then one byte per move giving the index of
+the move among the options calculate_options generates for the position
+under the header's rules, then one index entry per game. Integers are stored in native byte order */
+typedef struct
+{
+    char magic[RECORD_MAGIC_LEN];
+    uint8_t version, board_size, rules, reserved;
+    uint32_t games;
+    uint64_t index_offset;
+} record_header_t;
+
+typedef struct
+{
+    uint64_t offset;
+    uint32_t moves;
+    uint8_t result, reserved[3];
+} record_index_t;
+
+typedef struct
+{
+    /* A record file mapped into memory; moves are read straight from it */
+    uint8_t *data;
+    size_t size;
+    record_header_t *header;
+    record_index_t *index;
+} records_t;
+
+/* Called for the start and every position reached when replaying a game,
+with the game's result and whether this is its final position.
+Returning 0 stops the replay */
+typedef int (*visit_position_t)(board_t board, int movenum, int result,
+                                int final, void *arg);
+
+typedef struct
+{
+    /* Saved ahead of the table entries to check they are still usable */
+    char magic[RECORD_MAGIC_LEN];
+    uint8_t version, board_size, tt_bits, entry_size, rules, reserved[3];
+    int32_t lmr_moves, futility_margin; /* pruning the entries were found with */
+    uint64_t key_check, weights_check;
+} table_header_t;
+
+typedef struct
+{
+    /* One node entered or left by the search. Entries give the option
+    taken from the parent; exits give the value and TRACE_* flags */
+    uint64_t time;           /* nanoseconds since the move started */
+    int32_t alpha, beta, value;
+    uint8_t kind, depth, ply, flags, option, reserved[3];
+} trace_event_t;
+
+typedef struct
+{
+    /* Written ahead of the events of every move slower than the
+    threshold, so the report can name the options the events took */
+    char magic[RECORD_MAGIC_LEN];
+    uint8_t version, board_size, rules, reserved;
+    uint32_t movenum, events;
+    uint64_t elapsed, dropped; /* move time in ns; events overwritten */
+    char board[BOARD_SIZE * BOARD_SIZE];
+} trace_header_t;
+
+typedef struct
+{
+    /* A ring of the latest search events. The search runs on one thread
+    per process, so each match worker keeps its own ring */
+    trace_event_t *events;   /* NULL while tracing is off */
+    uint64_t next, move_first, move_start;
+    int ply, option, flags;
+    double threshold;        /* milliseconds */
+    char *filename;
+} trace_t;
+
+typedef struct
+{
+    /* Time and nodes spent below one option while replaying a trace */
+    uint64_t time, nodes, hits, cutoffs;
+} trace_stats_t;
+
+/* A position index is a header, then one entry per distinct position
+reached in a record file, sorted by key and then by position so it can
+be searched in place once mapped */
+typedef struct
+{
+    char magic[RECORD_MAGIC_LEN];
+    uint8_t version, board_size, entry_size, reserved[5];
+    uint64_t key_check, games, positions;
+} index_header_t;
+
+typedef struct
+{
+    /* One distinct position and how the games reaching it ended,
+    counted by RESULT_* code */
+    uint64_t key;              /* hash_board of the position */
+    packed_board_t position;   /* tells apart positions sharing a key */
+    uint32_t black_to_move, results[RESULT_KINDS];
+} index_entry_t;
+
+typedef struct
+{
+    /* A growable array of index entries */
+    index_entry_t *entries;
+    size_t count, size;
+} index_buffer_t;
+
+typedef struct
+{
+    /* A thread's share of the index build. Replaying, it sorts every
+    position of its games into one buffer per key range; merging, it
+    takes the key range numbered thread from every thread's buffers */
+    records_t *records;
+    uint32_t first, last;
+    int thread, threads, ok;
+    index_buffer_t *buffers, merged; /* buffers is threads x threads */
+} index_job_t;
+
+typedef struct
+{
+    /* A position index mapped into memory */
+    uint8_t *data;
+    size_t size;
+    index_header_t *header;
+    index_entry_t *entries;
+} position_index_t;
+
 typedef struct node decision_node_t;
 struct node
 {
     board_t board;
+    packed_board_t packed;
     int options, minimax_cost;
     move_t move;
     decision_node_t *next_move;
@@ -77,15 +434,25 @@ void print_board(board_t board);
 void fill_board(board_t board);
 void print_start(board_t board);
 int read_input(board_t board, char *instruction, int *moves);
+int parse_move(char *text, move_t *curmove);
+char *move_text(move_t curmove, char *text);
+int square_text(char *text, char col, char row);
+int is_capture(move_t curmove);
 void update_board(board_t board, move_t curmove, int capture);
 int promote_piece(char curpiece, char targetrow);
 int convert_to_index(char movenode);
 int legal_input(board_t board, move_t curmove, int *capture);
 int valid_move(board_t board, move_t curmove, int *capture);
-int calculate_cost(board_t board);
+int calculate_cost(packed_board_t *packed);
+void board_features(packed_board_t *packed, int features[EVAL_FEATURES]);
+void pack_board(board_t board, packed_board_t *packed);
+void update_packed(packed_board_t *packed, board_t board, move_t curmove,
+                   int capture);
+void init_masks(void);
+int load_weights(char *filename, int weights[EVAL_FEATURES]);
+int save_weights(char *filename, int weights[EVAL_FEATURES]);
 int capture_opposition(board_t board, move_t move);
 
-void recursive_addlayers(decision_node_t *node, int move, int tree_depth);
 void calculate_options(decision_node_t *node);
 void add_options(board_t board, int i, int j, decision_node_t *possible_moves,
                  int *index, int move);
@@ -97,20 +464,247 @@ void WB_move(board_t board, int i, int j, decision_node_t *possible_moves,
              int *index, int movenum);
 void test_direction(board_t board, decision_node_t *possible_moves,
                     int *index, int move, direction_t test);
-decision_node_t *create_move(board_t board, move_t moves);
+void extend_chain(board_t board, board_t scratch, int i, int j, int jumps,
+                  move_t *chain, decision_node_t *possible_moves, int *index);
+void add_option(board_t board, move_t moves, decision_node_t *possible_moves,
+                int *index);
+void keep_captures(decision_node_t *node);
+void create_move(decision_node_t *newnode, board_t board, move_t moves);
 void copy_board(board_t board1, board_t board2);
 void recursive_free(decision_node_t *root);
 int game_over(decision_node_t *root);
 void find_move(decision_node_t *root, move_t *best_move);
-void recur_fill_costs(decision_node_t *root, int depth);
-void propagate_cost(decision_node_t *root);
+int search_root(decision_node_t *root, char *excluded, int *best);
+int alpha_beta(decision_node_t *position, int movenum, int depth, int alpha,
+               int beta);
+int search_node(decision_node_t *position, int movenum, int depth, int alpha,
+                int beta);
+void order_options(decision_node_t *node, int hash_best, int order[],
+                   int scores[]);
+int move_key(move_t curmove);
+void record_cutoff(move_t curmove, int depth);
+
+void init_keys(void);
+void tt_init(void);
+void tt_clear(void);
+int tt_load(char *filename);
+int tt_save(char *filename);
+uint64_t weights_check(void);
+tt_entry_t *tt_probe(unsigned long long key);
+void tt_store(unsigned long long key, int depth, int value, int flag,
+              int best);
+unsigned long long hash_board(board_t board, int movenum);
+unsigned long long hash_packed(packed_board_t *packed, int movenum);
+unsigned long long next_random(unsigned long long *state);
 
+void analyse_position(board_t board, int move, int lines);
+int analyse_records(char *filename, int lines);
+int visit_final_position(board_t board, int movenum, int result, int final,
+                         void *arg);
+
+int convert_games(char *input, char *output);
+int move_index(board_t board, move_t curmove);
+void finish_record(board_t board, int move, uint64_t offset,
+                   record_index_t **index, int *games, int *size);
+int is_record_file(char *filename);
+int open_records(char *filename, records_t *records);
+void close_records(records_t *records);
+int replay_game(records_t *records, int game, visit_position_t visit,
+                void *arg);
+void print_pv(decision_node_t *first, int move);
+
+int build_index(char *input, char *output, int threads);
+void *index_games(void *arg);
+int visit_index_position(board_t board, int movenum, int result, int final,
+                         void *arg);
+void *merge_index_part(void *arg);
+void compact_index_buffer(index_buffer_t *buffer);
+int compare_index_entries(const void *first, const void *second);
+int open_index(char *filename, position_index_t *index);
+void close_index(position_index_t *index);
+index_entry_t *index_probe(position_index_t *index, board_t board,
+                           int movenum);
+void print_index_entry(index_entry_t *entry);
+
+void trace_init(char *filename, double threshold);
+uint64_t trace_clock(void);
+void trace_begin(void);
+void trace_event(int kind, int depth, int alpha, int beta, int value);
+void trace_end(board_t board, int movenum);
+int trace_report(char *filename);
+void report_trace_move(trace_header_t *header, trace_event_t *events);
+void print_trace_path(trace_header_t *header, int first, int second);
+
+void exec_board_size(char *argv[], int size);
+int play_input(options_t *options);
 int play_round(board_t board, int move, int check_gover);
+int parse_options(int argc, char *argv[], options_t *options);
+int count_threads(void);
+
+int run_tuner(options_t *options);
+int read_corpus(char *filename, tune_corpus_t *corpus);
+void add_position(tune_corpus_t *corpus, board_t board, int half_points);
+int visit_tune_position(board_t board, int movenum, int result, int final,
+                        void *arg);
+int parse_board(char *cells, board_t board);
+void *tune_slice(void *arg);
+double tune_step(tune_position_t *positions, int count, int threads,
+                 double *weights, double gradient[EVAL_FEATURES]);
+
+int run_match(options_t *options);
+int read_book(char *filename, move_t book[][MAX_BOOK_PLIES], int *lengths,
+              int *count);
+void match_worker(int worker, options_t *options, engine_t engines[],
+                  move_t book[][MAX_BOOK_PLIES], int *lengths, int openings,
+                  int fd);
+int play_match_game(engine_t engines[], int a_is_black, move_t *opening,
+                    int length, int random_plies, unsigned int seed);
+int choose_move(board_t board, int move, move_t *best_move);
+void use_engine(engine_t *engine);
+double sprt_llr(int wins, int draws, int losses, double elo0, double elo1);
+double score_to_elo(double score);
+void report_match(int wins, int draws, int losses, double llr,
+                  double lower, double upper);
+
+/* Evaluation weights; the defaults are the plain material count */
+int eval_weights[EVAL_FEATURES] = {COST_PIECE, COST_TOWER, 0, 0, 0, 0};
+int search_depth = TREE_DEPTH;
+int rules = RULES_DEFAULT;
+prune_t pruning = {0, 0};
+
+/* Transposition table, allocated on first use */
+tt_entry_t *tt = NULL;
+unsigned long long zobrist[BOARD_SIZE][BOARD_SIZE][PIECE_KINDS],
+    zobrist_black;
+/* Move ordering statistics, keyed by side and the from/to squares */
+int history[CHECK_ODDEVEN][SQUARES][SQUARES];
+int killers[KILLER_SLOTS][KILLERS];
+/* Square sets of the bitboard kernel, built by init_masks */
+board_masks_t board_masks;
+/* Position index queried by the analysis, mapped when -I is given */
+position_index_t corpus_index = {NULL, 0, NULL, NULL};
+/* Search event ring, allocated when -t is given */
+trace_t trace;
+char *feature_names[EVAL_FEATURES] = {"piece", "tower", "advance",
+                                      "back_rank", "centre",
+                                      "tower_mobility"};
 
 /*-------------------------------------------------------------------*/
 /* MAIN PLAY FUNCTIONS */
 
 int main(int argc, char *argv[])
+{
+    options_t options;
+    int status;
+    if (!parse_options(argc, argv, &options))
+    {
+        return EXIT_FAILURE;
+    }
+    if (options.board_size != BOARD_SIZE)
+    {
+        /* Only returns if the other build could not be started */
+        exec_board_size(argv, options.board_size);
+        return EXIT_FAILURE;
+    }
+    init_masks();
+    if (options.weights_file && !load_weights(options.weights_file,
+                                              eval_weights))
+    {
+        return EXIT_FAILURE;
+    }
+    search_depth = options.depth;
+    pruning = options.pruning;
+    if (options.trace_file)
+    {
+        trace_init(options.trace_file, options.trace_threshold);
+    }
+    if (options.mode == MODE_TUNE)
+    {
+        return run_tuner(&options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else if (options.mode == MODE_MATCH)
+    {
+        return run_match(&options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else if (options.mode == MODE_CONVERT)
+    {
+        return convert_games(options.input_file, options.output_file)
+                   ? EXIT_SUCCESS
+                   : EXIT_FAILURE;
+    }
+    else if (options.mode == MODE_TRACE_REPORT)
+    {
+        return trace_report(options.input_file) ? EXIT_SUCCESS
+                                                : EXIT_FAILURE;
+    }
+    else if (options.mode == MODE_INDEX)
+    {
+        return build_index(options.records_file, options.output_file,
+                           options.threads)
+                   ? EXIT_SUCCESS
+                   : EXIT_FAILURE;
+    }
+    /* Searching modes can start from the table a previous run saved. A
+    warm table is not a cache of this run's results: see tt_load */
+    if (options.table_file)
+    {
+        tt_load(options.table_file);
+    }
+    if (options.index_file && !open_index(options.index_file, &corpus_index))
+    {
+        return EXIT_FAILURE;
+    }
+    if ((options.mode == MODE_ANALYSE) && options.records_file)
+    {
+        status = analyse_records(options.records_file, options.lines)
+                     ? EXIT_SUCCESS
+                     : EXIT_FAILURE;
+    }
+    else
+    {
+        status = play_input(&options);
+    }
+    if (options.table_file && !tt_save(options.table_file))
+    {
+        status = EXIT_FAILURE;
+    }
+    close_index(&corpus_index);
+    return status;
+}
+
+void exec_board_size(char *argv[], int size)
+{
+    /* Replace this process with the build for another board size, named
+    like this one but with the size as its suffix (none for the default) */
+    char path[PATH_LEN], suffix[INT_TEXT_LEN] = "";
+    size_t len = strlen(argv[0]);
+    if (BOARD_SIZE != DEFAULT_BOARD_SIZE)
+    {
+        sprintf(suffix, "%d", BOARD_SIZE);
+    }
+    /* Strip this build's suffix to find the default build's name */
+    if ((len > strlen(suffix)) &&
+        (strcmp(argv[0] + len - strlen(suffix), suffix) == 0))
+    {
+        len -= strlen(suffix);
+    }
+    if (len + INT_TEXT_LEN > PATH_LEN)
+    {
+        printf("ERROR: Program path %s is too long.\n", argv[0]);
+        return;
+    }
+    memcpy(path, argv[0], len);
+    path[len] = '\0';
+    if (size != DEFAULT_BOARD_SIZE)
+    {
+        sprintf(path + len, "%d", size);
+    }
+    execvp(path, argv);
+    printf("ERROR: Board size %d needs a build with -DBOARD_SIZE=%d"
+           " (%s).\n", size, size, path);
+}
+
+int play_input(options_t *options)
 {
     /* Stage 0 */
     board_t board;
@@ -122,6 +716,12 @@ int main(int argc, char *argv[])
     {
         return EXIT_FAILURE;
     }
+    if (options->mode == MODE_ANALYSE)
+    {
+        /* The instruction only marks the end of the moves here */
+        analyse_position(board, move, options->lines);
+        return EXIT_SUCCESS;
+    }
     /* Stage 1 */
     if (instruction == PLAY_ONE_MOVE)
     {
@@ -152,7 +752,9 @@ int play_round(board_t board, int move, int check_gover)
     decision_node_t *root = malloc(sizeof(decision_node_t));
     move_t *best_move = malloc(sizeof(move_t));
     copy_board(root->board, board);
-    recursive_addlayers(root, move, INITIAL_DEPTH);
+    pack_board(root->board, &root->packed);
+    root->move.movenum = move;
+    calculate_options(root);
     find_move(root, best_move);
     best_move->movenum = move;
     /* Check if the game is over */
@@ -197,6 +799,226 @@ int play_round(board_t board, int move, int check_gover)
     return 1;
 }
 
+int parse_options(int argc, char *argv[], options_t *options)
+{
+    /* Read the mode and flags from the command line.
+    Return 1 if they are valid, 0 otherwise */
+    int i = 1;
+    options->mode = MODE_PLAY;
+    options->board_size = BOARD_SIZE;
+    options->threads = count_threads();
+    options->epochs = TUNE_EPOCHS;
+    options->lines = MULTI_PV;
+    options->depth = options->depth_b = TREE_DEPTH;
+    options->pruning.lmr_moves = options->pruning_b.lmr_moves = 0;
+    options->pruning.futility_margin = 0;
+    options->pruning_b.futility_margin = 0;
+    options->games = MATCH_GAMES;
+    options->opening_plies = OPENING_PLIES;
+    options->seed = 1;
+    options->elo0 = SPRT_ELO0;
+    options->elo1 = SPRT_ELO1;
+    options->weights_file = options->weights_file_b = NULL;
+    options->corpus_file = NULL;
+    options->output_file = NULL;
+    options->book_file = NULL;
+    options->input_file = options->records_file = NULL;
+    options->table_file = options->index_file = NULL;
+    options->trace_file = NULL;
+    options->trace_threshold = TRACE_THRESHOLD_MS;
+    if ((argc > 2) && (strcmp(argv[1], "tune") == 0))
+    {
+        options->mode = MODE_TUNE;
+        options->corpus_file = argv[2];
+        i = 3;
+    }
+    else if ((argc > 2) && (strcmp(argv[1], "convert") == 0))
+    {
+        options->mode = MODE_CONVERT;
+        options->input_file = argv[2];
+        i = 3;
+    }
+    else if ((argc > 2) && (strcmp(argv[1], "trace-report") == 0))
+    {
+        options->mode = MODE_TRACE_REPORT;
+        options->input_file = argv[2];
+        i = 3;
+    }
+    else if ((argc > 2) && (strcmp(argv[1], "index") == 0))
+    {
+        options->mode = MODE_INDEX;
+        options->records_file = argv[2];
+        i = 3;
+    }
+    else if ((argc > 1) && (strcmp(argv[1], "match") == 0))
+    {
+        options->mode = MODE_MATCH;
+        i = 2;
+    }
+    else if ((argc > 1) && (strcmp(argv[1], "analyse") == 0))
+    {
+        options->mode = MODE_ANALYSE;
+        i = 2;
+    }
+    for (; i < argc; i++)
+    {
+        /* Every remaining flag takes exactly one value */
+        if (i + 1 >= argc)
+        {
+            printf("ERROR: Missing value for %s.\n", argv[i]);
+            return 0;
+        }
+        if (strcmp(argv[i], "-w") == 0)
+        {
+            options->weights_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            options->output_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0)
+        {
+            options->threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-e") == 0)
+        {
+            options->epochs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            options->records_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-R") == 0)
+        {
+            /* 'c' turns on capture chains and 'f' forced captures */
+            i++;
+            rules = (strchr(argv[i], 'c') ? RULE_CHAINS : 0) |
+                    (strchr(argv[i], 'f') ? RULE_FORCED : 0);
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            options->board_size = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-T") == 0)
+        {
+            options->table_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-I") == 0)
+        {
+            options->index_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            options->trace_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-x") == 0)
+        {
+            options->trace_threshold = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-m") == 0)
+        {
+            options->lines = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-W") == 0)
+        {
+            options->weights_file_b = argv[++i];
+        }
+        else if (strcmp(argv[i], "-d") == 0)
+        {
+            options->depth = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            options->pruning.lmr_moves = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-Q") == 0)
+        {
+            options->pruning_b.lmr_moves = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-f") == 0)
+        {
+            options->pruning.futility_margin = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-F") == 0)
+        {
+            options->pruning_b.futility_margin = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-D") == 0)
+        {
+            options->depth_b = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-g") == 0)
+        {
+            options->games = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-k") == 0)
+        {
+            options->book_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            options->opening_plies = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            options->seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-l") == 0)
+        {
+            options->elo0 = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-u") == 0)
+        {
+            options->elo1 = atof(argv[++i]);
+        }
+        else
+        {
+            printf("ERROR: Unknown option %s.\n", argv[i]);
+            return 0;
+        }
+    }
+    if ((options->threads < 1) || (options->epochs < 1) ||
+        (options->lines < 1) ||
+        (options->depth < 1) || (options->depth_b < 1) ||
+        (options->games < 1) || (options->opening_plies < 0) ||
+        (options->pruning.lmr_moves < 0) ||
+        (options->pruning_b.lmr_moves < 0) ||
+        (options->pruning.futility_margin < 0) ||
+        (options->pruning_b.futility_margin < 0) ||
+        (options->trace_threshold < 0))
+    {
+        printf("ERROR: Counts and depths must be positive.\n");
+        return 0;
+    }
+    if (options->elo1 <= options->elo0)
+    {
+        printf("ERROR: SPRT needs elo0 below elo1.\n");
+        return 0;
+    }
+    if ((options->mode == MODE_CONVERT) && !options->output_file)
+    {
+        printf("ERROR: convert needs an output file (-o).\n");
+        return 0;
+    }
+    if ((options->mode == MODE_INDEX) && !options->output_file)
+    {
+        printf("ERROR: index needs an output file (-o).\n");
+        return 0;
+    }
+    return 1;
+}
+
+int count_threads(void)
+{
+    /* Use one worker thread per online CPU */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+    {
+        return DEFAULT_THREADS;
+    }
+    return (int)cpus;
+}
+
 /*-------------------------------------------------------------------*/
 /* GAMEPLAY VALIDATION FUNCTIONS */
 void fill_board(board_t board)
@@ -248,6 +1070,8 @@ void fill_board(board_t board)
 void print_move(board_t board, int programmove, move_t curmove)
 {
     /* Print the current move */
+    char text[MOVE_TEXT_LEN];
+    packed_board_t packed;
     printf(MOVE_SEPERATOR);
     /* Check if we're reading a move or the program is playing it */
     if (programmove)
@@ -257,17 +1081,16 @@ void print_move(board_t board, int programmove, move_t curmove)
     /* Check if black or white move (given black starts) */
     if (curmove.movenum % CHECK_ODDEVEN == BLACK_MOVE)
     {
-        printf("BLACK ACTION #%d: %c%c-%c%c\n", curmove.movenum,
-               curmove.sourcecol, curmove.sourcerow,
-               curmove.targetcol, curmove.targetrow);
+        printf("BLACK ACTION #%d: %s\n", curmove.movenum,
+               move_text(curmove, text));
     }
     else
     {
-        printf("WHITE ACTION #%d: %c%c-%c%c\n", curmove.movenum,
-               curmove.sourcecol, curmove.sourcerow,
-               curmove.targetcol, curmove.targetrow);
+        printf("WHITE ACTION #%d: %s\n", curmove.movenum,
+               move_text(curmove, text));
     }
-    printf("BOARD COST: %d\n", calculate_cost(board));
+    pack_board(board, &packed);
+    printf("BOARD COST: %d\n", calculate_cost(&packed));
     print_board(board);
 }
 
@@ -280,7 +1103,7 @@ void print_board(board_t board)
     {
         printf(ROW_SEPERATOR);
         /* Print the current row number on the side */
-        printf(" %d |", i + 1);
+        printf("%2d |", i + 1);
         /* Print every item in that row */
         for (j = 0; j < BOARD_SIZE; j++)
         {
@@ -305,16 +1128,22 @@ int read_input(board_t board, char *instruction, int *moves)
     /* Interpret the input, print it all out.
     Return 1 if input is valid, 0 otherwise */
     int programmove = MOVE_READ, capture = NO_CAPTURE;
+    char line[MAX_LINE_LEN], text[MAX_LINE_LEN];
     move_t curmove;
     curmove.movenum = *moves;
-    while (scanf("%c%c-%c%c\n", &curmove.sourcecol, &curmove.sourcerow,
-                 &curmove.targetcol, &curmove.targetrow) != EOF)
+    curmove.sourcecol = '\0';
+    while (fgets(line, MAX_LINE_LEN, stdin))
     {
+        if (sscanf(line, "%s", text) != 1)
+        {
+            /* Blank lines are skipped */
+            continue;
+        }
         curmove.movenum++;
         /* Break if we are at the instruction */
-        if (((curmove.sourcecol == 'A') || (curmove.sourcecol == 'P')) &&
-            ((curmove.sourcerow == '\n') || (curmove.sourcerow == EOF)))
+        if (!parse_move(text, &curmove))
         {
+            curmove.sourcecol = text[0];
             break;
         }
         /* Check if input is legal */
@@ -331,38 +1160,136 @@ int read_input(board_t board, char *instruction, int *moves)
     return 1;
 }
 
-void update_board(board_t board, move_t curmove, int capture)
+int parse_move(char *text, move_t *curmove)
 {
-    /* Update the board with the read move; assuming input validity */
-    char *curpiece = NULL, *target = NULL, *deleted = NULL;
-    int sourcerowi = convert_to_index(curmove.sourcerow),
-        sourcecoli = convert_to_index(curmove.sourcecol),
-        targetrowi = convert_to_index(curmove.targetrow),
-        targetcoli = convert_to_index(curmove.targetcol);
-    curpiece = &board[sourcerowi][sourcecoli];
-    target = &board[targetrowi][targetcoli];
-    /* Update the positions */
-    if (promote_piece(*curpiece, curmove.targetrow))
+    /* Read a move like "C6-B5", or a chain of captures like "C6-A4-C2".
+    Cells are only checked to be pairs of characters here; legal_input
+    checks they are on the board. Row 10 is stored as the one character
+    after '9'. Return 1 if text is a move, 0 otherwise */
+    int squares = 0, width;
+    char col, row;
+    curmove->hops = 0;
+    while ((text[0] != '\0') && (text[1] != '\0'))
     {
-        if (*curpiece == CELL_WPIECE)
+        col = text[0];
+        row = text[1];
+        width = 2;
+        if ((BOARD_SIZE > 9) && (row == '1') && (text[2] == '0'))
         {
-            *target = CELL_WTOWER;
+            row = '1' + 9;
+            width++;
+        }
+        if (squares == 0)
+        {
+            curmove->sourcecol = col;
+            curmove->sourcerow = row;
         }
         else
         {
-            *target = CELL_BTOWER;
+            if (squares > 1)
+            {
+                /* The previous target was only a landing square */
+                if (curmove->hops == MAX_HOPS)
+                {
+                    return 0;
+                }
+                curmove->hopcol[curmove->hops] = curmove->targetcol;
+                curmove->hoprow[curmove->hops++] = curmove->targetrow;
+            }
+            curmove->targetcol = col;
+            curmove->targetrow = row;
+        }
+        squares++;
+        text += width;
+        if (*text != '-')
+        {
+            break;
         }
+        text++;
     }
-    else
+    return (squares > 1) && ((*text == '\0') || (*text == '\n'));
+}
+
+char *move_text(move_t curmove, char *text)
+{
+    /* Write a move as "C6-B5", with any landing squares in between */
+    int hop, len;
+    len = square_text(text, curmove.sourcecol, curmove.sourcerow);
+    for (hop = 0; hop < curmove.hops; hop++)
     {
-        *target = *curpiece;
+        text[len++] = '-';
+        len += square_text(text + len, curmove.hopcol[hop],
+                           curmove.hoprow[hop]);
     }
+    text[len++] = '-';
+    square_text(text + len, curmove.targetcol, curmove.targetrow);
+    return text;
+}
+
+int square_text(char *text, char col, char row)
+{
+    /* Write one square, printing rows past '9' as numbers. Return its length */
+    if (row > '9')
+    {
+        return sprintf(text, "%c%d", col, row - '0');
+    }
+    return sprintf(text, "%c%c", col, row);
+}
+
+int is_capture(move_t curmove)
+{
+    /* Check if a move jumps at least one piece */
+    return (curmove.hops > 0) ||
+           ((abs(curmove.sourcecol - curmove.targetcol) == CAPTURE_DIST) &&
+            (abs(curmove.sourcerow - curmove.targetrow) == CAPTURE_DIST));
+}
+
+void update_board(board_t board, move_t curmove, int capture)
+{
+    /* Update the board with the read move; assuming input validity */
+    char *curpiece = NULL, *target = NULL, piece;
+    int sourcerowi = convert_to_index(curmove.sourcerow),
+        sourcecoli = convert_to_index(curmove.sourcecol),
+        targetrowi = convert_to_index(curmove.targetrow),
+        targetcoli = convert_to_index(curmove.targetcol),
+        fromrowi = sourcerowi, fromcoli = sourcecoli, torowi, tocoli, hop;
+    curpiece = &board[sourcerowi][sourcecoli];
+    target = &board[targetrowi][targetcoli];
+    /* Lift the piece first, since a chain can end where it started */
+    piece = *curpiece;
     *curpiece = CELL_EMPTY;
+    /* Update the positions */
+    if (promote_piece(piece, curmove.targetrow))
+    {
+        if (piece == CELL_WPIECE)
+        {
+            *target = CELL_WTOWER;
+        }
+        else
+        {
+            *target = CELL_BTOWER;
+        }
+    }
+    else
+    {
+        *target = piece;
+    }
     if (capture)
     {
-        /* Need to delete the piece in between */
-        deleted = &board[(sourcerowi + targetrowi) / 2][(sourcecoli + targetcoli) / 2];
-        *deleted = CELL_EMPTY;
+        /* Need to delete the piece in between every pair of landings */
+        for (hop = 0; hop <= curmove.hops; hop++)
+        {
+            torowi = (hop < curmove.hops)
+                         ? convert_to_index(curmove.hoprow[hop])
+                         : targetrowi;
+            tocoli = (hop < curmove.hops)
+                         ? convert_to_index(curmove.hopcol[hop])
+                         : targetcoli;
+            board[(fromrowi + torowi) / 2][(fromcoli + tocoli) / 2] =
+                CELL_EMPTY;
+            fromrowi = torowi;
+            fromcoli = tocoli;
+        }
     }
 }
 
@@ -373,7 +1300,7 @@ int promote_piece(char curpiece, char targetrow)
     {
         return 1;
     }
-    else if ((curpiece == 'w') && (targetrow == '8'))
+    else if ((curpiece == 'w') && (targetrow == '1' + BOARD_SIZE - 1))
     {
         return 1;
     }
@@ -387,12 +1314,12 @@ int convert_to_index(char movenode)
     int move_index;
     /* Subtracting the ASCII value of A from any of the
     chars will give its index (finding ASCII value relative to A) */
-    if ((movenode >= 'A') && (movenode <= 'H'))
+    if ((movenode >= 'A') && (movenode < 'A' + BOARD_SIZE))
     {
         move_index = (int)movenode - (int)'A';
         /* Subtract the ASCII value of '1' for the same reason */
     }
-    else if ((movenode >= '1') && (movenode <= '8'))
+    else if ((movenode >= '1') && (movenode < '1' + BOARD_SIZE))
     {
         move_index = (int)movenode - (int)'1';
     }
@@ -429,7 +1356,8 @@ int legal_input(board_t board, move_t curmove, int *capture)
         printf("ERROR: Source cell is empty.\n");
         return 0;
     }
-    else if (targetpiece != CELL_EMPTY)
+    else if ((targetpiece != CELL_EMPTY) &&
+             ((sourcerowi != targetrowi) || (sourcecoli != targetcoli)))
     {
         printf("ERROR: Target cell is not empty.\n");
         return 0;
@@ -446,6 +1374,17 @@ int legal_input(board_t board, move_t curmove, int *capture)
         return 0;
         /* Check the move is a move allowable by the rules */
     }
+    else if (rules != RULES_DEFAULT)
+    {
+        /* Chains and forced captures are only known to the generator */
+        if (move_index(board, curmove) == NO_MOVE)
+        {
+            printf("ERROR: Illegal action.\n");
+            return 0;
+        }
+        *capture = is_capture(curmove) ? CAPTURE_OCCURS : NO_CAPTURE;
+        return 1;
+    }
     else if (!valid_move(board, curmove, capture))
     {
         return 0;
@@ -523,362 +1462,2697 @@ int capture_opposition(board_t board, move_t move)
     }
 }
 
-int calculate_cost(board_t board)
+int calculate_cost(packed_board_t *packed)
+{
+    /* Calculate the current cost of the board as the weighted features */
+    int features[EVAL_FEATURES], i, cost = 0;
+    board_features(packed, features);
+    for (i = 0; i < EVAL_FEATURES; i++)
+    {
+        cost += eval_weights[i] * features[i];
+    }
+    return cost;
+}
+
+void board_features(packed_board_t *packed, int features[EVAL_FEATURES])
+{
+    /* Count every evaluation feature as black's total minus white's */
+    bitboard_t black = packed->black & ~packed->towers,
+               white = packed->white & ~packed->towers, towers, empty;
+    int k;
+    features[FEAT_PIECE] = POPCOUNT(black) - POPCOUNT(white);
+    features[FEAT_TOWER] = POPCOUNT(packed->black & packed->towers) -
+                           POPCOUNT(packed->white & packed->towers);
+    features[FEAT_BACK_RANK] =
+        POPCOUNT(black & board_masks.rows[BOARD_SIZE - 1]) -
+        POPCOUNT(white & board_masks.rows[0]);
+    features[FEAT_CENTRE] = POPCOUNT(packed->black & board_masks.centre) -
+                            POPCOUNT(packed->white & board_masks.centre);
+    /* Black starts at the bottom and advances up the rows */
+    features[FEAT_ADVANCE] = 0;
+    for (k = 0; k < BOARD_SIZE; k++)
+    {
+        features[FEAT_ADVANCE] +=
+            (BOARD_SIZE - 1 - k) * POPCOUNT(black & board_masks.rows[k]) -
+            k * POPCOUNT(white & board_masks.rows[k]);
+    }
+    /* Towers move both ways, so count their free diagonals */
+    features[FEAT_TOWER_MOBILITY] = 0;
+    empty = board_masks.dark & ~(packed->black | packed->white);
+    for (towers = packed->towers; towers; towers &= towers - 1)
+    {
+        k = LOWEST_BIT(towers);
+        features[FEAT_TOWER_MOBILITY] +=
+            ((packed->black >> k) & 1 ? 1 : -1) *
+            POPCOUNT(board_masks.diagonals[k] & empty);
+    }
+}
+
+void pack_board(board_t board, packed_board_t *packed)
 {
-    /* Calculate the current cost of the board */
-    int i, j, cost = 0;
+    /* Pack the dark squares of a board into one bit each, numbered
+    row by row from the top left, to key positions exactly */
+    int i, j, bit = 0;
+    char cell;
+    packed->black = packed->white = packed->towers = 0;
     for (i = 0; i < BOARD_SIZE; i++)
     {
-        for (j = 0; j < BOARD_SIZE; j++)
+        for (j = (i + 1) % CHECK_ODDEVEN; j < BOARD_SIZE;
+             j += CHECK_ODDEVEN, bit++)
         {
-            if (board[i][j] == CELL_WPIECE)
+            cell = board[i][j];
+            if (cell == CELL_EMPTY)
             {
-                cost--;
+                continue;
             }
-            else if (board[i][j] == CELL_BPIECE)
+            if ((cell == CELL_BPIECE) || (cell == CELL_BTOWER))
             {
-                cost++;
+                packed->black |= (bitboard_t)1 << bit;
             }
-            else if (board[i][j] == CELL_WTOWER)
+            else
             {
-                cost -= COST_TOWER;
+                packed->white |= (bitboard_t)1 << bit;
             }
-            else if (board[i][j] == CELL_BTOWER)
+            if ((cell == CELL_BTOWER) || (cell == CELL_WTOWER))
             {
-                cost += COST_TOWER;
+                packed->towers |= (bitboard_t)1 << bit;
             }
         }
     }
-    return cost;
 }
 
-/*-------------------------------------------------------------------*/
-/* MOVE FINDING FUNCTIONS */
-
-void recursive_addlayers(decision_node_t *node, int move, int tree_depth)
+void update_packed(packed_board_t *packed, board_t board, move_t curmove,
+                   int capture)
 {
-    /* Add depth to the tree in a recursive call at a specified depth */
-    int i;
-    node->move.movenum = move;
-    node->options = NO_OPTIONS;
-    if (tree_depth > TREE_DEPTH)
-    {
-        return;
-    }
-    calculate_options(node);
-    if (node->options != NO_OPTIONS)
+    /* Make the move update_board made on board, which is the board after
+    the move and tells whether the piece landed as a tower */
+    int sourcerowi = convert_to_index(curmove.sourcerow),
+        sourcecoli = convert_to_index(curmove.sourcecol),
+        targetrowi = convert_to_index(curmove.targetrow),
+        targetcoli = convert_to_index(curmove.targetcol),
+        fromrowi = sourcerowi, fromcoli = sourcecoli, torowi, tocoli, hop;
+    bitboard_t source = (bitboard_t)1 << (sourcerowi * HALF_ROW +
+                                          sourcecoli / CHECK_ODDEVEN),
+               target = (bitboard_t)1 << (targetrowi * HALF_ROW +
+                                          targetcoli / CHECK_ODDEVEN),
+               captured = 0, *side;
+    char piece = board[targetrowi][targetcoli];
+    side = (packed->black & source) ? &packed->black : &packed->white;
+    *side &= ~source;
+    packed->towers &= ~source;
+    if (capture)
     {
-        for (i = 0; i < (node->options); i++)
+        /* Every pair of landings jumps the square in between */
+        for (hop = 0; hop <= curmove.hops; hop++)
         {
-            recursive_addlayers(node->next_move + i, move + 1, tree_depth + 1);
+            torowi = (hop < curmove.hops)
+                         ? convert_to_index(curmove.hoprow[hop])
+                         : targetrowi;
+            tocoli = (hop < curmove.hops)
+                         ? convert_to_index(curmove.hopcol[hop])
+                         : targetcoli;
+            captured |= (bitboard_t)1
+                        << ((fromrowi + torowi) / 2 * HALF_ROW +
+                            (fromcoli + tocoli) / 2 / CHECK_ODDEVEN);
+            fromrowi = torowi;
+            fromcoli = tocoli;
         }
+        packed->black &= ~captured;
+        packed->white &= ~captured;
+        packed->towers &= ~captured;
+    }
+    *side |= target;
+    if ((piece == CELL_BTOWER) || (piece == CELL_WTOWER))
+    {
+        packed->towers |= target;
     }
-    return;
 }
 
-void calculate_options(decision_node_t *node)
+void init_masks(void)
 {
-    /* Fill the array of possible move options for a board */
-    decision_node_t *possible_moves = malloc(TEAM_PIECES * MAX_POS_MOVES *
-                                             sizeof(decision_node_t));
-    int i, j, index = 0;
+    /* Build the square sets of the bitboard kernel */
+    int i, j, addi, addj, bit = 0;
+    memset(&board_masks, 0, sizeof(board_masks));
     for (i = 0; i < BOARD_SIZE; i++)
     {
-        for (j = 0; j < BOARD_SIZE; j++)
+        for (j = (i + 1) % CHECK_ODDEVEN; j < BOARD_SIZE;
+             j += CHECK_ODDEVEN, bit++)
         {
-            /* Add possibilities */
-            if ((node->move.movenum) % CHECK_ODDEVEN == BLACK_MOVE)
+            board_masks.row[bit] = i;
+            board_masks.col[bit] = j;
+            board_masks.dark |= (bitboard_t)1 << bit;
+            board_masks.rows[i] |= (bitboard_t)1 << bit;
+            if ((i >= CENTRE_MARGIN) && (i < BOARD_SIZE - CENTRE_MARGIN) &&
+                (j >= CENTRE_MARGIN) && (j < BOARD_SIZE - CENTRE_MARGIN))
+            {
+                board_masks.centre |= (bitboard_t)1 << bit;
+            }
+            for (addi = BLACK_DIRECTION; addi <= WHITE_DIRECTION;
+                 addi += DIRECTION_DISTANCE)
             {
-                /* It must be black's move */
-                if (((node->board[i][j]) == CELL_BPIECE) ||
-                    ((node->board[i][j]) == CELL_BTOWER))
+                for (addj = BLACK_DIRECTION; addj <= WHITE_DIRECTION;
+                     addj += DIRECTION_DISTANCE)
                 {
-                    add_options(node->board, i, j, possible_moves,
-                                &index, node->move.movenum);
+                    if ((i + addi >= 0) && (i + addi < BOARD_SIZE) &&
+                        (j + addj >= 0) && (j + addj < BOARD_SIZE))
+                    {
+                        board_masks.diagonals[bit] |=
+                            (bitboard_t)1 << ((i + addi) * HALF_ROW +
+                                              (j + addj) / CHECK_ODDEVEN);
+                    }
                 }
             }
-            else if (((node->board[i][j]) == CELL_WPIECE) ||
-                     ((node->board[i][j]) == CELL_WTOWER))
+        }
+    }
+}
+
+int load_weights(char *filename, int weights[EVAL_FEATURES])
+{
+    /* Read "name value" lines into the weights; features not named keep
+    their current weight. Return 1 if the file is valid, 0 otherwise */
+    FILE *fp = fopen(filename, "r");
+    char line[MAX_LINE_LEN], name[MAX_LINE_LEN];
+    int value, i;
+    if (!fp)
+    {
+        printf("ERROR: Cannot open weights file %s.\n", filename);
+        return 0;
+    }
+    while (fgets(line, MAX_LINE_LEN, fp))
+    {
+        if ((line[0] == '#') || (sscanf(line, "%s", name) != 1))
+        {
+            /* Skip comments and blank lines */
+            continue;
+        }
+        if (sscanf(line, "%s %d", name, &value) != 2)
+        {
+            printf("ERROR: Bad weights line: %s", line);
+            fclose(fp);
+            return 0;
+        }
+        for (i = 0; i < EVAL_FEATURES; i++)
+        {
+            if (strcmp(name, feature_names[i]) == 0)
             {
-                /* It must be white's move */
-                add_options(node->board, i, j, possible_moves,
-                            &index, node->move.movenum);
+                weights[i] = value;
+                break;
             }
         }
+        if (i == EVAL_FEATURES)
+        {
+            printf("ERROR: Unknown weight %s.\n", name);
+            fclose(fp);
+            return 0;
+        }
     }
-    node->options = index;
-    node->next_move = possible_moves;
+    fclose(fp);
+    return 1;
 }
 
-void add_options(board_t board, int i, int j,
-                 decision_node_t *possible_moves, int *index, int move)
+int save_weights(char *filename, int weights[EVAL_FEATURES])
 {
-    /* Create the options array so we can set it in our tree */
-    char curpiece = board[i][j];
-    if (curpiece == CELL_WPIECE)
+    /* Write the weights in the format load_weights reads, to stdout if no
+    file is given. Return 1 on success, 0 otherwise */
+    FILE *fp = filename ? fopen(filename, "w") : stdout;
+    int i;
+    if (!fp)
     {
-        /* Handle 'w' piece */
-        w_move(board, i, j, possible_moves, index, move);
+        printf("ERROR: Cannot write weights file %s.\n", filename);
+        return 0;
     }
-    else if (curpiece == CELL_BPIECE)
+    for (i = 0; i < EVAL_FEATURES; i++)
     {
-        /* Handle 'b' piece */
-        b_move(board, i, j, possible_moves, index, move);
+        fprintf(fp, "%s %d\n", feature_names[i], weights[i]);
     }
-    else if ((curpiece == CELL_WTOWER) || (curpiece == CELL_BTOWER))
+    if (filename)
     {
-        /* Handle 'W' and 'B' piece, which have same move range */
-        WB_move(board, i, j, possible_moves, index, move);
+        fclose(fp);
     }
+    return 1;
 }
 
-void w_move(board_t board, int i, int j, decision_node_t *possible_moves,
-            int *index, int movenum)
+/*-------------------------------------------------------------------*/
+/* WEIGHT TUNING FUNCTIONS */
+
+int run_tuner(options_t *options)
 {
-    /* Handle the possible directions that the piece 'w' could move */
-    direction_t test;
-    int addi = WHITE_DIRECTION, addj;
-    /* Need to traverse the options clockwise from North East */
-    for (addj = WHITE_DIRECTION; addj >= BLACK_DIRECTION;
-         addj -= DIRECTION_DISTANCE)
+    /* Fit the evaluation weights to a corpus of labelled positions by
+    minimising the squared error between the game results and a sigmoid
+    of the evaluation, with Adam steps on the full-batch gradient.
+    Return 1 on success, 0 otherwise */
+    tune_corpus_t corpus;
+    double weights[EVAL_FEATURES], gradient[EVAL_FEATURES],
+        mean[EVAL_FEATURES] = {0}, var[EVAL_FEATURES] = {0}, loss = 0,
+        scale = eval_weights[FEAT_PIECE] ? eval_weights[FEAT_PIECE] : 1;
+    int epoch, i, tuned[EVAL_FEATURES];
+    if (!read_corpus(options->corpus_file, &corpus))
     {
-        test.j = j;
-        test.i = i;
-        test.addj = addj;
-        test.addi = addi;
-        test_direction(board, possible_moves, index, movenum, test);
+        return 0;
     }
-}
-
-void b_move(board_t board, int i, int j, decision_node_t *possible_moves,
-            int *index, int movenum)
-{
-    /* Handle the possible directions that the piece 'b' could move */
-    direction_t test;
-    int addi = BLACK_DIRECTION, addj;
-    /* Need to traverse the options clockwise from North East */
-    for (addj = WHITE_DIRECTION; addj >= BLACK_DIRECTION;
-         addj -= DIRECTION_DISTANCE)
+    /* Work in units of one piece so the sigmoid scale is meaningful */
+    for (i = 0; i < EVAL_FEATURES; i++)
     {
-        test.j = j;
-        test.i = i;
-        test.addj = addj;
-        test.addi = addi;
-        test_direction(board, possible_moves, index, movenum, test);
+        weights[i] = eval_weights[i] / scale;
+    }
+    for (epoch = 1; epoch <= options->epochs; epoch++)
+    {
+        loss = tune_step(corpus.positions, corpus.count, options->threads,
+                         weights, gradient);
+        for (i = 0; i < EVAL_FEATURES; i++)
+        {
+            mean[i] = 0.9 * mean[i] + 0.1 * gradient[i];
+            var[i] = 0.999 * var[i] + 0.001 * gradient[i] * gradient[i];
+            weights[i] -= TUNE_RATE * (mean[i] / (1 - pow(0.9, epoch))) /
+                          (sqrt(var[i] / (1 - pow(0.999, epoch))) + 1e-8);
+        }
+        if ((epoch % TUNE_REPORT_EVERY == 0) || (epoch == 1))
+        {
+            fprintf(stderr, "EPOCH %d LOSS %.6f\n", epoch, loss);
+        }
+    }
+    free(corpus.positions);
+    for (i = 0; i < EVAL_FEATURES; i++)
+    {
+        tuned[i] = (int)lround(weights[i] * TUNE_WEIGHT_SCALE);
     }
+    return save_weights(options->output_file, tuned);
 }
 
-void WB_move(board_t board, int i, int j, decision_node_t *possible_moves,
-             int *index, int movenum)
+int read_corpus(char *filename, tune_corpus_t *corpus)
 {
-    /* Handle the possible directions that the piece 'B' or 'W' could move */
-    direction_t test;
-    int addi, addj;
-    /* Need to traverse the options clockwise from North East */
-    for (addj = WHITE_DIRECTION; addj >= BLACK_DIRECTION;
-         addj -= DIRECTION_DISTANCE)
+    /* Read a record file, labelling every position of each finished game
+    with its result, or lines of BOARD_SIZE*BOARD_SIZE cells in row major
+    order followed by the result for black (1 win, 0.5 draw, 0 loss), into
+    a compact array of feature vectors. Return 1 on success, 0 otherwise */
+    FILE *fp;
+    char line[MAX_LINE_LEN], cells[MAX_LINE_LEN];
+    double result;
+    board_t board;
+    records_t records;
+    uint32_t game;
+    corpus->count = 0;
+    corpus->size = INITIAL_INDEX;
+    corpus->positions = malloc(corpus->size * sizeof(tune_position_t));
+    assert(corpus->positions);
+    if (is_record_file(filename))
     {
-        for (addi = BLACK_DIRECTION; addi <= WHITE_DIRECTION;
-             addi += DIRECTION_DISTANCE)
+        if (!open_records(filename, &records))
         {
-            test.j = j;
-            test.i = i;
-            test.addj = addj;
-            test.addi = addi;
-            test_direction(board, possible_moves, index, movenum, test);
+            free(corpus->positions);
+            return 0;
+        }
+        for (game = 0; game < records.header->games; game++)
+        {
+            if (!replay_game(&records, game, visit_tune_position, corpus))
+            {
+                close_records(&records);
+                free(corpus->positions);
+                return 0;
+            }
+        }
+        close_records(&records);
+    }
+    else
+    {
+        if (!(fp = fopen(filename, "r")))
+        {
+            printf("ERROR: Cannot open corpus %s.\n", filename);
+            free(corpus->positions);
+            return 0;
+        }
+        while (fgets(line, MAX_LINE_LEN, fp))
+        {
+            if ((sscanf(line, "%s %lf", cells, &result) != 2) ||
+                !parse_board(cells, board) || (result < 0) || (result > 1))
+            {
+                printf("ERROR: Bad corpus line: %s", line);
+                free(corpus->positions);
+                fclose(fp);
+                return 0;
+            }
+            add_position(corpus, board, (int)lround(result * HALF_POINTS));
         }
+        fclose(fp);
     }
+    if (corpus->count == 0)
+    {
+        printf("ERROR: Corpus %s is empty.\n", filename);
+        free(corpus->positions);
+        return 0;
+    }
+    return 1;
 }
 
-void test_direction(board_t board, decision_node_t *possible_moves,
-                    int *index, int move, direction_t test)
+void add_position(tune_corpus_t *corpus, board_t board, int half_points)
 {
-    /* Test if a piece can play in this direction, either moving/capturing */
-    /* Ensure attempted move is on the board and target cell empty */
-    move_t new_move;
-    new_move.movenum = move;
-    /* Is there a move available? */
-    if ((test.i + test.addi >= 0) && (test.i + test.addi < BOARD_SIZE) && (test.j + test.addj >= 0) && (test.j + test.addj < BOARD_SIZE) &&
-        (board[test.i + test.addi][test.j + test.addj] == '.'))
+    /* Append a board's features and result to the corpus */
+    int features[EVAL_FEATURES], i;
+    packed_board_t packed;
+    tune_position_t *grown;
+    if (corpus->count == corpus->size)
     {
-        new_move.sourcecol = test.j + 'A';
-        new_move.targetcol = test.j + test.addj + 'A';
-        new_move.sourcerow = test.i + '1';
-        new_move.targetrow = test.i + test.addi + '1';
-        possible_moves[(*index)++] = *create_move(board, new_move);
-        /* No move, see if we can capture (if on board, near cell wont be empty) */
+        corpus->size *= 2;
+        grown = realloc(corpus->positions,
+                        corpus->size * sizeof(tune_position_t));
+        assert(grown);
+        corpus->positions = grown;
     }
-    else if ((test.i + CAPTURE_DIST * test.addi >= 0) &&
-             (test.i + CAPTURE_DIST * test.addi < BOARD_SIZE) &&
-             (test.j + CAPTURE_DIST * test.addj < BOARD_SIZE) &&
-             (test.j + CAPTURE_DIST * test.addj >= 0) &&
-             (board[test.i +
-                    CAPTURE_DIST * test.addi][test.j + CAPTURE_DIST * test.addj] == '.'))
+    pack_board(board, &packed);
+    board_features(&packed, features);
+    for (i = 0; i < EVAL_FEATURES; i++)
     {
-        new_move.sourcecol = test.j + 'A';
-        new_move.targetcol = test.j + CAPTURE_DIST * test.addj + 'A';
-        new_move.sourcerow = test.i + '1';
-        new_move.targetrow = test.i + CAPTURE_DIST * test.addi + '1';
-        /* Ensure we are capturing the other piece */
-        if (!capture_opposition(board, new_move))
-        {
-            return;
-        }
-        possible_moves[(*index)++] = *create_move(board, new_move);
+        corpus->positions[corpus->count].features[i] =
+            (feature_t)features[i];
     }
+    corpus->positions[corpus->count++].result = (unsigned char)half_points;
 }
 
-decision_node_t *create_move(board_t board, move_t moves)
+int visit_tune_position(board_t board, int movenum, int result, int final,
+                        void *arg)
 {
-    int capture = NO_CAPTURE;
-    decision_node_t *newnode = malloc(sizeof(decision_node_t));
-    copy_board(newnode->board, board);
-    if (abs(moves.sourcecol - moves.targetcol) == CAPTURE_DIST &&
-        abs(moves.sourcerow - moves.targetrow) == CAPTURE_DIST)
+    /* Label a replayed position with its game's result for black */
+    (void)movenum;
+    (void)final;
+    if (result == RESULT_BLACK)
     {
-        capture = CAPTURE_OCCURS;
+        add_position(arg, board, HALF_POINTS);
     }
-    update_board(newnode->board, moves, capture);
-    newnode->next_move = NULL;
-    /* Note: Movenum will be updated at the start of the recursive call */
-    newnode->move = moves;
-    return newnode;
+    else if (result == RESULT_WHITE)
+    {
+        add_position(arg, board, 0);
+    }
+    else if (result == RESULT_DRAW)
+    {
+        add_position(arg, board, 1);
+    }
+    return 1;
 }
 
-void copy_board(board_t board1, board_t board2)
+int parse_board(char *cells, board_t board)
 {
+    /* Fill a board from a row major string of cells. Pieces may only
+    stand on the dark squares. Return 1 if every cell is valid, 0 otherwise */
     int i, j;
+    char cell;
+    if (strlen(cells) != BOARD_SIZE * BOARD_SIZE)
+    {
+        return 0;
+    }
     for (i = 0; i < BOARD_SIZE; i++)
     {
         for (j = 0; j < BOARD_SIZE; j++)
         {
-            board1[i][j] = board2[i][j];
+            cell = cells[i * BOARD_SIZE + j];
+            if ((cell != CELL_EMPTY) && (cell != CELL_BPIECE) &&
+                (cell != CELL_WPIECE) && (cell != CELL_BTOWER) &&
+                (cell != CELL_WTOWER))
+            {
+                return 0;
+            }
+            if ((cell != CELL_EMPTY) && ((i + j) % CHECK_ODDEVEN == 0))
+            {
+                return 0;
+            }
+            board[i][j] = cell;
         }
     }
+    return 1;
 }
 
-void recursive_free(decision_node_t *root)
+double tune_step(tune_position_t *positions, int count, int threads,
+                 double *weights, double gradient[EVAL_FEATURES])
 {
-    /* Recursively free all the memory in a decision tree */
-    int i;
-    if (root)
+    /* Split the corpus across threads and sum the gradient of the mean
+    squared error, returning the mean squared error */
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    tune_job_t *jobs = malloc(threads * sizeof(tune_job_t));
+    int t, i, start = 0, slice = (count + threads - 1) / threads;
+    double loss = 0;
+    assert(ids && jobs);
+    for (t = 0; t < threads; t++)
     {
-        for (i = 0; i < (root->options); i++)
+        jobs[t].positions = positions + start;
+        jobs[t].count = (start + slice > count) ? count - start : slice;
+        jobs[t].weights = weights;
+        start += jobs[t].count;
+        pthread_create(&ids[t], NULL, tune_slice, &jobs[t]);
+    }
+    for (i = 0; i < EVAL_FEATURES; i++)
+    {
+        gradient[i] = 0;
+    }
+    for (t = 0; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+        loss += jobs[t].loss;
+        for (i = 0; i < EVAL_FEATURES; i++)
         {
-            recursive_free(root->next_move + i);
+            gradient[i] += jobs[t].gradient[i] / count;
         }
-        free(root->next_move);
     }
+    free(ids);
+    free(jobs);
+    return loss / count;
 }
 
-int game_over(decision_node_t *root)
+void *tune_slice(void *arg)
 {
-    /* Check if the game is over, returning who won if so */
-    if (root->options == NO_OPTIONS)
+    /* Sum the squared error and its gradient over one slice of the corpus */
+    tune_job_t *job = arg;
+    tune_position_t *position;
+    double eval, predicted, error, slope;
+    int p, i;
+    job->loss = 0;
+    for (i = 0; i < EVAL_FEATURES; i++)
     {
-        /* The game must be over if there are no available moves */
-        if (root->move.movenum % CHECK_ODDEVEN == BLACK_MOVE)
+        job->gradient[i] = 0;
+    }
+    for (p = 0; p < job->count; p++)
+    {
+        position = job->positions + p;
+        eval = 0;
+        for (i = 0; i < EVAL_FEATURES; i++)
         {
-            return INT_MAX;
+            eval += job->weights[i] * position->features[i];
         }
-        else
+        predicted = 1 / (1 + exp(-TUNE_SIGMOID_K * eval));
+        error = (double)position->result / HALF_POINTS - predicted;
+        job->loss += error * error;
+        /* Derivative of the squared error with respect to the evaluation */
+        slope = -2 * error * TUNE_SIGMOID_K * predicted * (1 - predicted);
+        for (i = 0; i < EVAL_FEATURES; i++)
         {
-            return INT_MIN;
+            job->gradient[i] += slope * position->features[i];
         }
     }
-    else
-    {
-        return 0;
-    }
+    return NULL;
 }
 
-void find_move(decision_node_t *root, move_t *best_move)
+/*-------------------------------------------------------------------*/
+/* SELF-PLAY MATCH FUNCTIONS */
+
+int run_match(options_t *options)
+{
+    /* Play engine A (-w, -d) against engine B (-W, -D) over pairs of games
+    with colours swapped, spread across forked worker processes, until a
+    sequential probability ratio test on A's score accepts a hypothesis or
+    the game cap is reached. Return 1 on success, 0 otherwise */
+    engine_t engines[2];
+    move_t(*book)[MAX_BOOK_PLIES] = NULL;
+    int lengths[MAX_BOOK_LINES], openings = 0, fds[2], worker, played = 0,
+        points[HALF_POINTS + 1] = {0}, workers = options->threads;
+    pid_t *pids;
+    match_result_t result;
+    double lower = log(SPRT_BETA / (1 - SPRT_ALPHA)),
+           upper = log((1 - SPRT_BETA) / SPRT_ALPHA), llr = 0;
+    memcpy(engines[0].weights, eval_weights, sizeof(eval_weights));
+    memcpy(engines[1].weights, eval_weights, sizeof(eval_weights));
+    engines[0].depth = options->depth;
+    engines[1].depth = options->depth_b;
+    engines[0].pruning = options->pruning;
+    engines[1].pruning = options->pruning_b;
+    if (options->weights_file_b &&
+        !load_weights(options->weights_file_b, engines[1].weights))
+    {
+        return 0;
+    }
+    if (options->book_file)
+    {
+        book = malloc(MAX_BOOK_LINES * sizeof(*book));
+        assert(book);
+        if (!read_book(options->book_file, book, lengths, &openings))
+        {
+            free(book);
+            return 0;
+        }
+    }
+    if (pipe(fds) != 0)
+    {
+        printf("ERROR: Cannot create match pipe.\n");
+        free(book);
+        return 0;
+    }
+    /* Flush now so the workers do not inherit and repeat buffered output */
+    fflush(stdout);
+    pids = malloc(workers * sizeof(pid_t));
+    assert(pids);
+    for (worker = 0; worker < workers; worker++)
+    {
+        pids[worker] = fork();
+        if (pids[worker] == 0)
+        {
+            close(fds[0]);
+            match_worker(worker, options, engines, book, lengths, openings,
+                         fds[1]);
+            close(fds[1]);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    close(fds[1]);
+    while (read(fds[0], &result, sizeof(result)) == sizeof(result))
+    {
+        points[result.points]++;
+        played++;
+        llr = sprt_llr(points[HALF_POINTS], points[1], points[0],
+                       options->elo0, options->elo1);
+        if ((llr <= lower) || (llr >= upper) || (played >= options->games))
+        {
+            break;
+        }
+    }
+    /* Stop any games still in progress */
+    for (worker = 0; worker < workers; worker++)
+    {
+        if (pids[worker] > 0)
+        {
+            kill(pids[worker], SIGTERM);
+            waitpid(pids[worker], NULL, 0);
+        }
+    }
+    close(fds[0]);
+    free(pids);
+    free(book);
+    report_match(points[HALF_POINTS], points[1], points[0], llr, lower,
+                 upper);
+    return 1;
+}
+
+int read_book(char *filename, move_t book[][MAX_BOOK_PLIES], int *lengths,
+              int *count)
+{
+    /* Read one opening per line as space separated moves like "C6-B5",
+    checking every move is legal. Return 1 on success, 0 otherwise */
+    FILE *fp = fopen(filename, "r");
+    char line[MAX_LINE_LEN], *token;
+    board_t board;
+    int capture = NO_CAPTURE, ply;
+    move_t *curmove;
+    if (!fp)
+    {
+        printf("ERROR: Cannot open book %s.\n", filename);
+        return 0;
+    }
+    *count = 0;
+    while (fgets(line, MAX_LINE_LEN, fp) && (*count < MAX_BOOK_LINES))
+    {
+        fill_board(board);
+        ply = 0;
+        for (token = strtok(line, " \t\r\n"); token && ply < MAX_BOOK_PLIES;
+             token = strtok(NULL, " \t\r\n"))
+        {
+            curmove = &book[*count][ply];
+            curmove->movenum = ply + 1;
+            if (!parse_move(token, curmove) ||
+                !legal_input(board, *curmove, &capture))
+            {
+                printf("ERROR: Bad book move %s.\n", token);
+                fclose(fp);
+                return 0;
+            }
+            update_board(board, *curmove, capture);
+            ply++;
+        }
+        if (ply > 0)
+        {
+            lengths[(*count)++] = ply;
+        }
+    }
+    fclose(fp);
+    if (*count == 0)
+    {
+        printf("ERROR: Book %s is empty.\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+void match_worker(int worker, options_t *options, engine_t engines[],
+                  move_t book[][MAX_BOOK_PLIES], int *lengths, int openings,
+                  int fd)
+{
+    /* Play every game whose number is this worker's modulo the worker
+    count. Games come in pairs sharing an opening with colours swapped */
+    match_result_t result;
+    int opening;
+    for (result.game = worker; result.game < options->games;
+         result.game += options->threads)
+    {
+        opening = result.game / CHECK_ODDEVEN;
+        if (book)
+        {
+            result.points = play_match_game(
+                engines, result.game % CHECK_ODDEVEN == 0,
+                book[opening % openings], lengths[opening % openings], 0, 0);
+        }
+        else
+        {
+            result.points = play_match_game(
+                engines, result.game % CHECK_ODDEVEN == 0, NULL, 0,
+                options->opening_plies, options->seed + opening);
+        }
+        if (write(fd, &result, sizeof(result)) != sizeof(result))
+        {
+            return;
+        }
+    }
+}
+
+int play_match_game(engine_t engines[], int a_is_black, move_t *opening,
+                    int length, int random_plies, unsigned int seed)
+{
+    /* Play one game from a book opening or from random_plies random moves,
+    returning engine A's score in half points */
+    board_t board;
+    decision_node_t node;
+    move_t best_move;
+    int move = INITIAL_MOVE + 1, capture = NO_CAPTURE, over = 0, ply;
+    /* Nothing is kept from the worker's previous game, so a result does
+    not depend on which games a worker happened to play before it */
+    tt_clear();
+    fill_board(board);
+    for (ply = 0; ply < length; ply++)
+    {
+        legal_input(board, opening[ply], &capture);
+        update_board(board, opening[ply], capture);
+        move++;
+    }
+    for (ply = 0; ply < random_plies; ply++)
+    {
+        copy_board(node.board, board);
+        pack_board(node.board, &node.packed);
+        node.move.movenum = move;
+        calculate_options(&node);
+        if (node.options == NO_OPTIONS)
+        {
+            free(node.next_move);
+            break;
+        }
+        copy_board(board, node.next_move[rand_r(&seed) % node.options].board);
+        free(node.next_move);
+        move++;
+    }
+    while (move <= MAX_GAME_PLIES)
+    {
+        /* Engine A moves on black's turns exactly when it plays black */
+        use_engine(&engines[(move % CHECK_ODDEVEN == BLACK_MOVE) !=
+                            a_is_black]);
+        over = choose_move(board, move, &best_move);
+        if (over)
+        {
+            break;
+        }
+        legal_input(board, best_move, &capture);
+        update_board(board, best_move, capture);
+        move++;
+    }
+    if (!over)
+    {
+        return 1;
+    }
+    /* game_over reports the winner the same way play_round prints it */
+    return ((over == INT_MAX) == a_is_black) ? HALF_POINTS : 0;
+}
+
+int choose_move(board_t board, int move, move_t *best_move)
+{
+    /* Search for the best move without printing anything, returning
+    game_over's value for the position (0 if there are moves to play) */
+    decision_node_t root;
+    int over;
+    copy_board(root.board, board);
+    pack_board(root.board, &root.packed);
+    root.move.movenum = move;
+    calculate_options(&root);
+    over = game_over(&root);
+    if (!over)
+    {
+        find_move(&root, best_move);
+        best_move->movenum = move;
+    }
+    recursive_free(&root);
+    return over;
+}
+
+void use_engine(engine_t *engine)
+{
+    /* Switch the evaluation and search to the given configuration */
+    if ((memcmp(eval_weights, engine->weights, sizeof(eval_weights)) != 0) ||
+        (memcmp(&pruning, &engine->pruning, sizeof(prune_t)) != 0) ||
+        (search_depth != engine->depth))
+    {
+        /* Stored costs were found by the other configuration; even deeper
+        entries of the same evaluation would play a shallow engine up */
+        memcpy(eval_weights, engine->weights, sizeof(eval_weights));
+        pruning = engine->pruning;
+        search_depth = engine->depth;
+        tt_clear();
+    }
+}
+
+double sprt_llr(int wins, int draws, int losses, double elo0, double elo1)
+{
+    /* Log likelihood ratio of elo1 against elo0 for the observed results,
+    using the normal approximation to the per-game score distribution */
+    int games = wins + draws + losses;
+    double score, variance, score0, score1;
+    if (games == 0)
+    {
+        return 0;
+    }
+    score = (wins + 0.5 * draws) / games;
+    variance = (wins * (1 - score) * (1 - score) +
+                draws * (0.5 - score) * (0.5 - score) +
+                losses * score * score) /
+               games;
+    if (variance <= 0)
+    {
+        return 0;
+    }
+    score0 = 1 / (1 + pow(10, -elo0 / ELO_SCALE));
+    score1 = 1 / (1 + pow(10, -elo1 / ELO_SCALE));
+    return games * (score1 - score0) * (2 * score - score0 - score1) /
+           (2 * variance);
+}
+
+double score_to_elo(double score)
+{
+    /* Convert an expected score into an elo difference */
+    if (score <= 0)
+    {
+        return -INFINITY;
+    }
+    else if (score >= 1)
+    {
+        return INFINITY;
+    }
+    return ELO_SCALE * log10(score / (1 - score));
+}
+
+void report_match(int wins, int draws, int losses, double llr,
+                  double lower, double upper)
+{
+    /* Print engine A's results with a 95% elo interval and SPRT verdict */
+    int games = wins + draws + losses;
+    double score = 0.5, margin = 0;
+    if (games > 0)
+    {
+        score = (wins + 0.5 * draws) / games;
+        margin = CONFIDENCE_Z *
+                 sqrt((wins * (1 - score) * (1 - score) +
+                       draws * (0.5 - score) * (0.5 - score) +
+                       losses * score * score) /
+                      games / games);
+    }
+    printf("GAMES: %d (W %d / D %d / L %d)\n", games, wins, draws, losses);
+    printf("ELO: %.1f [%.1f, %.1f]\n", score_to_elo(score),
+           score_to_elo(score - margin), score_to_elo(score + margin));
+    printf("LLR: %.2f [%.2f, %.2f] ", llr, lower, upper);
+    if (llr >= upper)
+    {
+        printf("H1 ACCEPTED\n");
+    }
+    else if (llr <= lower)
+    {
+        printf("H0 ACCEPTED\n");
+    }
+    else
+    {
+        printf("INCONCLUSIVE\n");
+    }
+}
+
+/*-------------------------------------------------------------------*/
+/* MOVE FINDING FUNCTIONS */
+
+void calculate_options(decision_node_t *node)
+{
+    /* Fill the array of possible move options for a board */
+    decision_node_t *possible_moves = malloc(MAX_OPTIONS *
+                                             sizeof(decision_node_t));
+    int i, bit, index = 0;
+    bitboard_t pieces = ((node->move.movenum) % CHECK_ODDEVEN == BLACK_MOVE)
+                            ? node->packed.black
+                            : node->packed.white;
+    /* Bits run in row major order, so options come out as a scan of the
+    board would find them */
+    for (; pieces; pieces &= pieces - 1)
+    {
+        bit = LOWEST_BIT(pieces);
+        add_options(node->board, board_masks.row[bit], board_masks.col[bit],
+                    possible_moves, &index, node->move.movenum);
+    }
+    for (i = 0; i < index; i++)
+    {
+        /* Each option carries the parent's bitboards with its move made */
+        possible_moves[i].packed = node->packed;
+        update_packed(&possible_moves[i].packed, possible_moves[i].board,
+                      possible_moves[i].move,
+                      is_capture(possible_moves[i].move) ? CAPTURE_OCCURS
+                                                         : NO_CAPTURE);
+    }
+    node->options = index;
+    node->next_move = possible_moves;
+    if (rules & RULE_FORCED)
+    {
+        keep_captures(node);
+    }
+}
+
+void add_options(board_t board, int i, int j,
+                 decision_node_t *possible_moves, int *index, int move)
+{
+    /* Create the options array so we can set it in our tree */
+    char curpiece = board[i][j];
+    if (curpiece == CELL_WPIECE)
+    {
+        /* Handle 'w' piece */
+        w_move(board, i, j, possible_moves, index, move);
+    }
+    else if (curpiece == CELL_BPIECE)
+    {
+        /* Handle 'b' piece */
+        b_move(board, i, j, possible_moves, index, move);
+    }
+    else if ((curpiece == CELL_WTOWER) || (curpiece == CELL_BTOWER))
+    {
+        /* Handle 'W' and 'B' piece, which have same move range */
+        WB_move(board, i, j, possible_moves, index, move);
+    }
+}
+
+void w_move(board_t board, int i, int j, decision_node_t *possible_moves,
+            int *index, int movenum)
+{
+    /* Handle the possible directions that the piece 'w' could move */
+    direction_t test;
+    int addi = WHITE_DIRECTION, addj;
+    /* Need to traverse the options clockwise from North East */
+    for (addj = WHITE_DIRECTION; addj >= BLACK_DIRECTION;
+         addj -= DIRECTION_DISTANCE)
+    {
+        test.j = j;
+        test.i = i;
+        test.addj = addj;
+        test.addi = addi;
+        test_direction(board, possible_moves, index, movenum, test);
+    }
+}
+
+void b_move(board_t board, int i, int j, decision_node_t *possible_moves,
+            int *index, int movenum)
+{
+    /* Handle the possible directions that the piece 'b' could move */
+    direction_t test;
+    int addi = BLACK_DIRECTION, addj;
+    /* Need to traverse the options clockwise from North East */
+    for (addj = WHITE_DIRECTION; addj >= BLACK_DIRECTION;
+         addj -= DIRECTION_DISTANCE)
+    {
+        test.j = j;
+        test.i = i;
+        test.addj = addj;
+        test.addi = addi;
+        test_direction(board, possible_moves, index, movenum, test);
+    }
+}
+
+void WB_move(board_t board, int i, int j, decision_node_t *possible_moves,
+             int *index, int movenum)
+{
+    /* Handle the possible directions that the piece 'B' or 'W' could move */
+    direction_t test;
+    int addi, addj;
+    /* Need to traverse the options clockwise from North East */
+    for (addj = WHITE_DIRECTION; addj >= BLACK_DIRECTION;
+         addj -= DIRECTION_DISTANCE)
+    {
+        for (addi = BLACK_DIRECTION; addi <= WHITE_DIRECTION;
+             addi += DIRECTION_DISTANCE)
+        {
+            test.j = j;
+            test.i = i;
+            test.addj = addj;
+            test.addi = addi;
+            test_direction(board, possible_moves, index, movenum, test);
+        }
+    }
+}
+
+void test_direction(board_t board, decision_node_t *possible_moves,
+                    int *index, int move, direction_t test)
+{
+    /* Test if a piece can play in this direction, either moving/capturing */
+    /* Ensure attempted move is on the board and target cell empty */
+    move_t new_move;
+    board_t scratch;
+    int landi = test.i + CAPTURE_DIST * test.addi,
+        landj = test.j + CAPTURE_DIST * test.addj;
+    new_move.movenum = move;
+    new_move.hops = 0;
+    /* Is there a move available? */
+    if ((test.i + test.addi >= 0) && (test.i + test.addi < BOARD_SIZE) && (test.j + test.addj >= 0) && (test.j + test.addj < BOARD_SIZE) &&
+        (board[test.i + test.addi][test.j + test.addj] == '.'))
+    {
+        new_move.sourcecol = test.j + 'A';
+        new_move.targetcol = test.j + test.addj + 'A';
+        new_move.sourcerow = test.i + '1';
+        new_move.targetrow = test.i + test.addi + '1';
+        add_option(board, new_move, possible_moves, index);
+        /* No move, see if we can capture (if on board, near cell wont be empty) */
+    }
+    else if ((landi >= 0) && (landi < BOARD_SIZE) && (landj < BOARD_SIZE) &&
+             (landj >= 0) && (board[landi][landj] == '.'))
+    {
+        new_move.sourcecol = test.j + 'A';
+        new_move.targetcol = landj + 'A';
+        new_move.sourcerow = test.i + '1';
+        new_move.targetrow = landi + '1';
+        /* Ensure we are capturing the other piece */
+        if (!capture_opposition(board, new_move))
+        {
+            return;
+        }
+        if (!(rules & RULE_CHAINS) ||
+            promote_piece(board[test.i][test.j], new_move.targetrow))
+        {
+            /* A piece that is promoted ends its move there */
+            add_option(board, new_move, possible_moves, index);
+            return;
+        }
+        /* Keep jumping from the landing square on a scratch board */
+        copy_board(scratch, board);
+        scratch[landi][landj] = scratch[test.i][test.j];
+        scratch[test.i][test.j] = CELL_EMPTY;
+        scratch[test.i + test.addi][test.j + test.addj] = CELL_CAPTURED;
+        extend_chain(board, scratch, landi, landj, 1, &new_move,
+                     possible_moves, index);
+    }
+}
+
+void extend_chain(board_t board, board_t scratch, int i, int j, int jumps,
+                  move_t *chain, decision_node_t *possible_moves, int *index)
+{
+    /* Depth first search for further jumps by the piece at (i, j) of the
+    scratch board, where pieces already jumped are marked as captured so
+    they cannot be jumped twice. Every chain that cannot go on is added */
+    char piece = scratch[i][j], jumped;
+    int addi, addj, midi, midj, landi, landj, extended = 0,
+        black = (piece == CELL_BPIECE) || (piece == CELL_BTOWER);
+    for (addj = WHITE_DIRECTION; addj >= BLACK_DIRECTION;
+         addj -= DIRECTION_DISTANCE)
+    {
+        for (addi = BLACK_DIRECTION; addi <= WHITE_DIRECTION;
+             addi += DIRECTION_DISTANCE)
+        {
+            /* Pieces only jump forwards, towers any way */
+            if (((piece == CELL_BPIECE) && (addi != BLACK_DIRECTION)) ||
+                ((piece == CELL_WPIECE) && (addi != WHITE_DIRECTION)))
+            {
+                continue;
+            }
+            midi = i + addi;
+            midj = j + addj;
+            landi = i + CAPTURE_DIST * addi;
+            landj = j + CAPTURE_DIST * addj;
+            if ((landi < 0) || (landi >= BOARD_SIZE) || (landj < 0) ||
+                (landj >= BOARD_SIZE) ||
+                (scratch[landi][landj] != CELL_EMPTY) ||
+                (chain->hops == MAX_HOPS))
+            {
+                continue;
+            }
+            jumped = scratch[midi][midj];
+            if (black ? ((jumped != CELL_WPIECE) && (jumped != CELL_WTOWER))
+                      : ((jumped != CELL_BPIECE) && (jumped != CELL_BTOWER)))
+            {
+                continue;
+            }
+            extended = 1;
+            /* The current target becomes a landing square on the way */
+            chain->hopcol[chain->hops] = chain->targetcol;
+            chain->hoprow[chain->hops++] = chain->targetrow;
+            chain->targetcol = landj + 'A';
+            chain->targetrow = landi + '1';
+            scratch[landi][landj] = piece;
+            scratch[i][j] = CELL_EMPTY;
+            scratch[midi][midj] = CELL_CAPTURED;
+            if (promote_piece(piece, chain->targetrow))
+            {
+                add_option(board, *chain, possible_moves, index);
+            }
+            else
+            {
+                extend_chain(board, scratch, landi, landj, jumps + 1, chain,
+                             possible_moves, index);
+            }
+            /* Undo the jump before trying the next direction */
+            scratch[midi][midj] = jumped;
+            scratch[i][j] = piece;
+            scratch[landi][landj] = CELL_EMPTY;
+            chain->hops--;
+            chain->targetcol = chain->hopcol[chain->hops];
+            chain->targetrow = chain->hoprow[chain->hops];
+        }
+    }
+    if (!extended && (jumps > 0))
+    {
+        add_option(board, *chain, possible_moves, index);
+    }
+}
+
+void add_option(board_t board, move_t moves, decision_node_t *possible_moves,
+                int *index)
+{
+    /* Add the board after a move to the options, if there is room */
+    if (*index == MAX_OPTIONS)
+    {
+        return;
+    }
+    create_move(possible_moves + (*index)++, board, moves);
+}
+
+void keep_captures(decision_node_t *node)
+{
+    /* Drop every non-capturing option if any option captures */
+    int i, kept = 0;
+    for (i = 0; i < node->options; i++)
+    {
+        if (is_capture(node->next_move[i].move))
+        {
+            node->next_move[kept++] = node->next_move[i];
+        }
+    }
+    if (kept > 0)
+    {
+        node->options = kept;
+    }
+}
+
+void create_move(decision_node_t *newnode, board_t board, move_t moves)
+{
+    /* Fill an option with the board after the move */
+    int capture = NO_CAPTURE;
+    copy_board(newnode->board, board);
+    if (is_capture(moves))
+    {
+        capture = CAPTURE_OCCURS;
+    }
+    update_board(newnode->board, moves, capture);
+    newnode->next_move = NULL;
+    newnode->options = NO_OPTIONS;
+    /* Note: Movenum will be updated when the option is searched */
+    newnode->move = moves;
+}
+
+void copy_board(board_t board1, board_t board2)
+{
+    int i, j;
+    for (i = 0; i < BOARD_SIZE; i++)
+    {
+        for (j = 0; j < BOARD_SIZE; j++)
+        {
+            board1[i][j] = board2[i][j];
+        }
+    }
+}
+
+void recursive_free(decision_node_t *root)
+{
+    /* Recursively free all the memory in a decision tree */
+    int i;
+    if (root)
+    {
+        for (i = 0; i < (root->options); i++)
+        {
+            recursive_free(root->next_move + i);
+        }
+        free(root->next_move);
+    }
+}
+
+int game_over(decision_node_t *root)
+{
+    /* Check if the game is over, returning who won if so */
+    if (root->options == NO_OPTIONS)
+    {
+        /* The game must be over if there are no available moves */
+        if (root->move.movenum % CHECK_ODDEVEN == BLACK_MOVE)
+        {
+            return INT_MAX;
+        }
+        else
+        {
+            return INT_MIN;
+        }
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+void find_move(decision_node_t *root, move_t *best_move)
+{
+    /* Play the best move available using the minimax search */
+    int best;
+    if (game_over(root))
+    {
+        /* We're not going to find any moves, so can return early */
+        root->move.movenum = game_over(root);
+        return;
+    }
+    search_root(root, NULL, &best);
+    *best_move = (root->next_move + best)->move;
+}
+
+int search_root(decision_node_t *root, char *excluded, int *best)
+{
+    /* Search every option of the root not marked in excluded, recording
+    each option's minimax_cost and the index of the first best option in
+    best. Every option that improves on the ones before it gets an exact
+    cost; the rest only get a bound no better than the best so far */
+    int i, cost, alpha = INT_MIN, beta = INT_MAX, maximising =
+        (root->move.movenum % CHECK_ODDEVEN == BLACK_MOVE);
+    *best = NO_MOVE;
+    trace_begin();
+    for (i = 0; i < root->options; i++)
+    {
+        if (excluded && excluded[i])
+        {
+            continue;
+        }
+        trace.option = i;
+        cost = alpha_beta(root->next_move + i, root->move.movenum + 1,
+                          search_depth - 1, alpha, beta);
+        (root->next_move + i)->minimax_cost = cost;
+        if ((*best == NO_MOVE) ||
+            (maximising ? (cost > alpha) : (cost < beta)))
+        {
+            *best = i;
+            if (maximising)
+            {
+                alpha = cost;
+            }
+            else
+            {
+                beta = cost;
+            }
+        }
+    }
+    trace_end(root->board, root->move.movenum);
+    return (*best == NO_MOVE) ? 0 : (root->next_move + *best)->minimax_cost;
+}
+
+int alpha_beta(decision_node_t *position, int movenum, int depth, int alpha,
+               int beta)
+{
+    /* Search a node, recording its entry and exit while tracing */
+    int cost;
+    if (!trace.events)
+    {
+        return search_node(position, movenum, depth, alpha, beta);
+    }
+    trace_event(TRACE_ENTER, depth, alpha, beta, 0);
+    cost = search_node(position, movenum, depth, alpha, beta);
+    trace_event(TRACE_EXIT, depth, alpha, beta, cost);
+    return cost;
+}
+
+int search_node(decision_node_t *position, int movenum, int depth, int alpha,
+                int beta)
+{
+    /* Find the minimax cost of an option's board to the given depth,
+    working on its bitboards for hashing, generation and evaluation.
+    Skips any option that cannot change the result. Black maximises, white
+    minimises.
+    Results are kept in the transposition table for repeated positions.
+    With pruning switched on, late quiet options are searched less deeply
+    and hopeless quiet options next to the leaves are skipped */
+    decision_node_t node;
+    unsigned long long key = hash_packed(&position->packed, movenum);
+    tt_entry_t *entry = tt_probe(key);
+    int order[MAX_OPTIONS], scores[MAX_OPTIONS], i, k, cost, quiet, reduced,
+        quiet_moves = 0, best = NO_MOVE, best_cost = 0, static_cost = 0,
+        start_alpha = alpha, start_beta = beta, flag,
+        maximising = (movenum % CHECK_ODDEVEN == BLACK_MOVE);
+    if (entry && (entry->depth >= depth))
+    {
+        if ((entry->flag == TT_EXACT) ||
+            ((entry->flag == TT_LOWER) && (entry->value >= beta)) ||
+            ((entry->flag == TT_UPPER) && (entry->value <= alpha)))
+        {
+            trace.flags = TRACE_TT_HIT;
+            return entry->value;
+        }
+    }
+    copy_board(node.board, position->board);
+    node.packed = position->packed;
+    node.move.movenum = movenum;
+    calculate_options(&node);
+    if ((node.options == NO_OPTIONS) || (depth == 0))
+    {
+        /* The game is over or this is a leaf, so nothing to search */
+        cost = (node.options == NO_OPTIONS) ? game_over(&node)
+                                            : calculate_cost(&node.packed);
+        free(node.next_move);
+        trace.flags = TRACE_LEAF;
+        return cost;
+    }
+    order_options(&node, entry ? entry->best : NO_BEST, order, scores);
+    if (pruning.futility_margin && (depth == 1))
+    {
+        static_cost = calculate_cost(&node.packed);
+    }
+    for (k = 0; k < node.options; k++)
+    {
+        i = order[k];
+        quiet = (k > 0) && (scores[i] < ORDER_KILLER);
+        if (quiet && pruning.futility_margin && (depth == 1) &&
+            (maximising ? (static_cost + pruning.futility_margin <= alpha)
+                        : (static_cost - pruning.futility_margin >= beta)))
+        {
+            /* A quiet move this far behind is not expected to catch up */
+            continue;
+        }
+        /* Only quiet moves count towards the ones searched fully, not the
+        hash move, captures or killers ordered ahead of them */
+        quiet_moves += quiet;
+        reduced = quiet && pruning.lmr_moves && (depth >= LMR_MIN_DEPTH) &&
+                  (quiet_moves > pruning.lmr_moves);
+        trace.option = i;
+        if (reduced)
+        {
+            /* Test the late move shallower with a null window first */
+            cost = alpha_beta(node.next_move + i, movenum + 1,
+                              depth - 1 - LMR_REDUCTION,
+                              maximising ? alpha : beta - 1,
+                              maximising ? alpha + 1 : beta);
+            /* It is searched fully only if it might change the bound */
+            reduced = maximising ? (cost <= alpha) : (cost >= beta);
+        }
+        if (!reduced)
+        {
+            trace.option = i;
+            cost = alpha_beta(node.next_move + i, movenum + 1, depth - 1,
+                              alpha, beta);
+        }
+        if ((best == NO_MOVE) ||
+            (maximising ? (cost > best_cost) : (cost < best_cost)))
+        {
+            best = i;
+            best_cost = cost;
+        }
+        if (maximising && (cost > alpha))
+        {
+            alpha = cost;
+        }
+        else if (!maximising && (cost < beta))
+        {
+            beta = cost;
+        }
+        if (alpha >= beta)
+        {
+            if (!is_capture((node.next_move + i)->move))
+            {
+                record_cutoff((node.next_move + i)->move, depth);
+            }
+            break;
+        }
+    }
+    free(node.next_move);
+    if (best_cost <= start_alpha)
+    {
+        flag = TT_UPPER;
+    }
+    else if (best_cost >= start_beta)
+    {
+        flag = TT_LOWER;
+    }
+    else
+    {
+        flag = TT_EXACT;
+    }
+    tt_store(key, depth, best_cost, flag, best);
+    trace.flags = (alpha >= beta) ? TRACE_CUTOFF : 0;
+    return best_cost;
+}
+
+void order_options(decision_node_t *node, int hash_best, int order[],
+                   int scores[])
+{
+    /* Order the options by score: the table's best first, then captures,
+    then killer moves, then quiet moves by history. Ties stay in generated
+    order */
+    int i, k, key, slot = node->move.movenum % KILLER_SLOTS,
+                   side = node->move.movenum % CHECK_ODDEVEN;
+    for (i = 0; i < node->options; i++)
+    {
+        key = move_key((node->next_move + i)->move);
+        if (i == hash_best)
+        {
+            scores[i] = ORDER_HASH;
+        }
+        else if (is_capture((node->next_move + i)->move))
+        {
+            scores[i] = ORDER_CAPTURE;
+        }
+        else if ((key == killers[slot][0]) || (key == killers[slot][1]))
+        {
+            scores[i] = ORDER_KILLER;
+        }
+        else
+        {
+            scores[i] = history[side][key / SQUARES][key % SQUARES];
+        }
+        /* Insertion sort, moving only past strictly lower scores */
+        for (k = i; (k > 0) && (scores[order[k - 1]] < scores[i]); k--)
+        {
+            order[k] = order[k - 1];
+        }
+        order[k] = i;
+    }
+}
+
+int move_key(move_t curmove)
+{
+    /* Number a move by its source and target squares */
+    return (convert_to_index(curmove.sourcerow) * BOARD_SIZE +
+            convert_to_index(curmove.sourcecol)) *
+               SQUARES +
+           convert_to_index(curmove.targetrow) * BOARD_SIZE +
+           convert_to_index(curmove.targetcol);
+}
+
+void record_cutoff(move_t curmove, int depth)
+{
+    /* Remember a quiet move that caused a cutoff as a killer for its
+    movenum and raise its history score */
+    int key = move_key(curmove), slot = curmove.movenum % KILLER_SLOTS,
+        *score = &history[curmove.movenum % CHECK_ODDEVEN][key / SQUARES]
+                         [key % SQUARES];
+    if (killers[slot][0] != key)
+    {
+        killers[slot][1] = killers[slot][0];
+        killers[slot][0] = key;
+    }
+    *score += depth * depth;
+    if (*score > HISTORY_MAX)
+    {
+        *score = HISTORY_MAX;
+    }
+}
+
+/*-------------------------------------------------------------------*/
+/* TRANSPOSITION TABLE FUNCTIONS */
+
+void init_keys(void)
+{
+    /* Fill the random keys used to hash boards. They come from a fixed
+    seed so hashes are the same every run and saved tables stay valid */
+    unsigned long long seed = ZOBRIST_SEED;
+    int i, j, k;
+    if (zobrist_black)
+    {
+        return;
+    }
+    for (i = 0; i < BOARD_SIZE; i++)
+    {
+        for (j = 0; j < BOARD_SIZE; j++)
+        {
+            for (k = 0; k < PIECE_KINDS; k++)
+            {
+                zobrist[i][j][k] = next_random(&seed);
+            }
+        }
+    }
+    zobrist_black = next_random(&seed);
+}
+
+void tt_init(void)
+{
+    /* Allocate an empty table unless one was already made or loaded */
+    init_keys();
+    if (tt)
+    {
+        return;
+    }
+    tt = calloc(TT_ENTRIES, sizeof(tt_entry_t));
+    assert(tt);
+}
+
+void tt_clear(void)
+{
+    /* Forget every stored result and ordering statistic, e.g. when the
+    evaluation changes */
+    if (tt)
+    {
+        memset(tt, 0, TT_ENTRIES * sizeof(tt_entry_t));
+    }
+    memset(history, 0, sizeof(history));
+    memset(killers, 0, sizeof(killers));
+}
+
+tt_entry_t *tt_probe(unsigned long long key)
+{
+    /* Return the table entry for this key, or NULL if there is none */
+    tt_entry_t *entry;
+    tt_init();
+    entry = tt + (key & (TT_ENTRIES - 1));
+    if ((entry->flag == TT_EMPTY) || (entry->key != key))
+    {
+        return NULL;
+    }
+    return entry;
+}
+
+void tt_store(unsigned long long key, int depth, int value, int flag,
+              int best)
+{
+    /* Save a search result, keeping a deeper result for the same board */
+    tt_entry_t *entry = tt + (key & (TT_ENTRIES - 1));
+    if ((entry->flag != TT_EMPTY) && (entry->key == key) &&
+        (entry->depth > depth))
+    {
+        return;
+    }
+    entry->key = key;
+    entry->value = value;
+    entry->depth = (signed char)depth;
+    entry->flag = (unsigned char)flag;
+    entry->best = (best == NO_MOVE) ? NO_BEST : (unsigned char)best;
+}
+
+int tt_load(char *filename)
+{
+    /* Map a table saved by tt_save as this run's table, and copy in the
+    history and killer moves saved after it. Table pages are copied only
+    when a search writes to them, so startup does not read the whole
+    file. A missing or stale file leaves the table cold.
+    A warm run can choose other moves than a cold one: entries searched
+    deeper by the earlier run are reused at shallower depths, and the
+    restored history and killers change the move order, which changes
+    the entries this run stores. Use a cold table to reproduce a game.
+    Return 1 if the table was loaded, 0 otherwise */
+    struct stat info;
+    table_header_t *header;
+    uint8_t *data;
+    int fd = open(filename, O_RDONLY);
+    size_t size = sizeof(table_header_t) +
+                  TT_ENTRIES * sizeof(tt_entry_t) + sizeof(history) +
+                  sizeof(killers);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if ((fstat(fd, &info) != 0) || ((size_t)info.st_size != size))
+    {
+        fprintf(stderr, "WARNING: Ignoring table %s of the wrong size.\n",
+                filename);
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "WARNING: Cannot map table %s.\n", filename);
+        return 0;
+    }
+    init_keys();
+    header = (table_header_t *)data;
+    if ((memcmp(header->magic, TABLE_MAGIC, RECORD_MAGIC_LEN) != 0) ||
+        (header->version != TABLE_VERSION) ||
+        (header->board_size != BOARD_SIZE) || (header->tt_bits != TT_BITS) ||
+        (header->rules != rules) ||
+        (header->entry_size != sizeof(tt_entry_t)) ||
+        (header->key_check != zobrist_black) ||
+        (header->weights_check != weights_check()) ||
+        (header->lmr_moves != pruning.lmr_moves) ||
+        (header->futility_margin != pruning.futility_margin))
+    {
+        /* Built by another version, evaluation or pruning */
+        fprintf(stderr, "WARNING: Ignoring stale table %s.\n", filename);
+        munmap(data, size);
+        return 0;
+    }
+    free(tt);
+    tt = (tt_entry_t *)(data + sizeof(table_header_t));
+    memcpy(history, tt + TT_ENTRIES, sizeof(history));
+    memcpy(killers, (uint8_t *)(tt + TT_ENTRIES) + sizeof(history),
+           sizeof(killers));
+    return 1;
+}
+
+int tt_save(char *filename)
+{
+    /* Write the table so a later run can tt_load it. The file is replaced
+    by a rename so a loaded mapping of the old one stays intact.
+    Return 1 on success, 0 otherwise */
+    char temp[MAX_LINE_LEN];
+    table_header_t header;
+    FILE *fp;
+    int ok;
+    tt_init();
+    snprintf(temp, MAX_LINE_LEN, "%s.tmp", filename);
+    if (!(fp = fopen(temp, "wb")))
+    {
+        printf("ERROR: Cannot write table %s.\n", temp);
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TABLE_MAGIC, RECORD_MAGIC_LEN);
+    header.version = TABLE_VERSION;
+    header.board_size = BOARD_SIZE;
+    header.tt_bits = TT_BITS;
+    header.rules = rules;
+    header.entry_size = sizeof(tt_entry_t);
+    header.key_check = zobrist_black;
+    header.weights_check = weights_check();
+    header.lmr_moves = pruning.lmr_moves;
+    header.futility_margin = pruning.futility_margin;
+    ok = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+         (fwrite(tt, sizeof(tt_entry_t), TT_ENTRIES, fp) == TT_ENTRIES) &&
+         (fwrite(history, sizeof(history), 1, fp) == 1) &&
+         (fwrite(killers, sizeof(killers), 1, fp) == 1);
+    ok = (fclose(fp) == 0) && ok && (rename(temp, filename) == 0);
+    if (!ok)
+    {
+        printf("ERROR: Cannot write table %s.\n", filename);
+        remove(temp);
+    }
+    return ok;
+}
+
+uint64_t weights_check(void)
+{
+    /* FNV-1a hash of the evaluation weights, since stored costs depend on
+    them */
+    uint64_t check = FNV_OFFSET;
+    size_t i;
+    unsigned char *bytes = (unsigned char *)eval_weights;
+    for (i = 0; i < sizeof(eval_weights); i++)
+    {
+        check = (check ^ bytes[i]) * FNV_PRIME;
+    }
+    return check;
+}
+
+unsigned long long hash_board(board_t board, int movenum)
+{
+    /* Zobrist hash of the pieces and the side to move */
+    packed_board_t packed;
+    pack_board(board, &packed);
+    return hash_packed(&packed, movenum);
+}
+
+unsigned long long hash_packed(packed_board_t *packed, int movenum)
+{
+    /* Zobrist hash of a packed board. The keys of a square are for a black
+    piece, a white piece, a black tower and a white tower in that order */
+    unsigned long long key = 0;
+    bitboard_t kinds[PIECE_KINDS], bits;
+    int kind, bit;
+    init_keys();
+    kinds[0] = packed->black & ~packed->towers;
+    kinds[1] = packed->white & ~packed->towers;
+    kinds[2] = packed->black & packed->towers;
+    kinds[3] = packed->white & packed->towers;
+    for (kind = 0; kind < PIECE_KINDS; kind++)
+    {
+        for (bits = kinds[kind]; bits; bits &= bits - 1)
+        {
+            bit = LOWEST_BIT(bits);
+            key ^= zobrist[board_masks.row[bit]][board_masks.col[bit]][kind];
+        }
+    }
+    if (movenum % CHECK_ODDEVEN == BLACK_MOVE)
+    {
+        key ^= zobrist_black;
+    }
+    return key;
+}
+
+unsigned long long next_random(unsigned long long *state)
+{
+    /* xorshift64* step, good enough for hash keys */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/*-------------------------------------------------------------------*/
+/* ANALYSIS FUNCTIONS */
+
+void analyse_position(board_t board, int move, int lines)
+{
+    /* Print the best few moves with their exact costs and principal
+    variations. Each line searches the root again with the moves already
+    reported excluded, so the table left by the earlier lines makes the
+    later ones cheap */
+    decision_node_t root;
+    char excluded[MAX_OPTIONS] = {0};
+    int line, best, cost;
+    copy_board(root.board, board);
+    pack_board(root.board, &root.packed);
+    root.move.movenum = move;
+    calculate_options(&root);
+    printf(MOVE_SEPERATOR);
+    if (game_over(&root))
+    {
+        printf("%s WIN!\n", (game_over(&root) == INT_MAX) ? "BLACK"
+                                                          : "WHITE");
+        recursive_free(&root);
+        return;
+    }
+    for (line = 1; line <= lines; line++)
+    {
+        cost = search_root(&root, excluded, &best);
+        if (best == NO_MOVE)
+        {
+            break;
+        }
+        excluded[best] = 1;
+        printf("MOVE %d: COST %d PV", line, cost);
+        print_pv(root.next_move + best, move);
+        putchar('\n');
+        if (corpus_index.data)
+        {
+            /* How the indexed games that played this move ended */
+            print_index_entry(index_probe(&corpus_index,
+                                          root.next_move[best].board,
+                                          move + 1));
+        }
+    }
+    recursive_free(&root);
+}
+
+void print_pv(decision_node_t *first, int move)
+{
+    /* Print a root option then follow the table's best replies from it */
+    decision_node_t node;
+    board_t board;
+    tt_entry_t *entry;
+    char text[MOVE_TEXT_LEN];
+    int ply;
+    printf(" %s", move_text(first->move, text));
+    copy_board(board, first->board);
+    for (ply = 1; ply < search_depth; ply++)
+    {
+        entry = tt_probe(hash_board(board, move + ply));
+        if (!entry || (entry->best == NO_BEST))
+        {
+            return;
+        }
+        copy_board(node.board, board);
+        pack_board(node.board, &node.packed);
+        node.move.movenum = move + ply;
+        calculate_options(&node);
+        if (entry->best >= node.options)
+        {
+            free(node.next_move);
+            return;
+        }
+        printf(" %s", move_text(node.next_move[entry->best].move, text));
+        copy_board(board, node.next_move[entry->best].board);
+        free(node.next_move);
+    }
+}
+
+int analyse_records(char *filename, int lines)
+{
+    /* Analyse the final position of every game in a record file.
+    Return 1 on success, 0 otherwise */
+    records_t records;
+    uint32_t game;
+    if (!open_records(filename, &records))
+    {
+        return 0;
+    }
+    for (game = 0; game < records.header->games; game++)
+    {
+        printf(MOVE_SEPERATOR);
+        printf("GAME %u\n", game + 1);
+        if (!replay_game(&records, game, visit_final_position, &lines))
+        {
+            close_records(&records);
+            return 0;
+        }
+    }
+    close_records(&records);
+    return 1;
+}
+
+int visit_final_position(board_t board, int movenum, int result, int final,
+                         void *arg)
+{
+    /* Only the position after the last move is analysed */
+    (void)result;
+    if (final)
+    {
+        analyse_position(board, movenum, *(int *)arg);
+    }
+    return 1;
+}
+
+/*-------------------------------------------------------------------*/
+/* GAME RECORD FUNCTIONS */
+
+int convert_games(char *input, char *output)
+{
+    /* Convert text games to a record file. Games are the usual move lines,
+    each ended by an instruction line, a blank line or the end of file.
+    The file is written under a temporary name and only renamed into place
+    once complete. Return 1 on success, 0 otherwise */
+    FILE *in = fopen(input, "r"), *out;
+    char line[MAX_LINE_LEN], text[MAX_LINE_LEN], temp[MAX_LINE_LEN];
+    board_t board;
+    record_header_t header;
+    record_index_t *index;
+    move_t curmove;
+    int move = INITIAL_MOVE + 1, games = 0, size = INITIAL_INDEX, capture,
+        option, ok = 1;
+    uint64_t offset = sizeof(header);
+    uint8_t byte = 0;
+    if (!in)
+    {
+        printf("ERROR: Cannot open games file %s.\n", input);
+        return 0;
+    }
+    snprintf(temp, MAX_LINE_LEN, "%s.tmp", output);
+    if (!(out = fopen(temp, "wb")))
+    {
+        printf("ERROR: Cannot write record file %s.\n", temp);
+        fclose(in);
+        return 0;
+    }
+    index = malloc(size * sizeof(record_index_t));
+    assert(index);
+    /* The header is written again once the index offset is known */
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, out);
+    fill_board(board);
+    while (ok && fgets(line, MAX_LINE_LEN, in))
+    {
+        if ((sscanf(line, "%s", text) != 1) || !parse_move(text, &curmove))
+        {
+            /* Anything that is not a move ends the current game */
+            finish_record(board, move, offset, &index, &games, &size);
+            offset += move - (INITIAL_MOVE + 1);
+            fill_board(board);
+            move = INITIAL_MOVE + 1;
+            continue;
+        }
+        curmove.movenum = move;
+        option = move_index(board, curmove);
+        if ((option == NO_MOVE) || !legal_input(board, curmove, &capture))
+        {
+            printf("ERROR: Illegal action %s in game %d.\n",
+                   move_text(curmove, text), games + 1);
+            ok = 0;
+            break;
+        }
+        byte = (uint8_t)option;
+        fwrite(&byte, 1, 1, out);
+        update_board(board, curmove, capture);
+        move++;
+    }
+    if (ok)
+    {
+        finish_record(board, move, offset, &index, &games, &size);
+        offset += move - (INITIAL_MOVE + 1);
+        /* Pad the moves so the index entries are aligned once mapped */
+        for (byte = 0; offset % RECORD_ALIGN; offset++)
+        {
+            fwrite(&byte, 1, 1, out);
+        }
+        memcpy(header.magic, RECORD_MAGIC, RECORD_MAGIC_LEN);
+        header.version = RECORD_VERSION;
+        header.board_size = BOARD_SIZE;
+        header.rules = rules;
+        header.games = games;
+        header.index_offset = offset;
+        ok = (fwrite(index, sizeof(record_index_t), games, out) ==
+              (size_t)games) &&
+             (fseek(out, 0, SEEK_SET) == 0) &&
+             (fwrite(&header, sizeof(header), 1, out) == 1) &&
+             !ferror(out);
+        if (!ok)
+        {
+            printf("ERROR: Cannot write record file %s.\n", temp);
+        }
+    }
+    free(index);
+    fclose(in);
+    if ((fclose(out) != 0) || (ok && (rename(temp, output) != 0)))
+    {
+        printf("ERROR: Cannot write record file %s.\n", output);
+        ok = 0;
+    }
+    if (!ok)
+    {
+        remove(temp);
+    }
+    else
+    {
+        printf("CONVERTED %d GAMES\n", games);
+    }
+    return ok;
+}
+
+int move_index(board_t board, move_t curmove)
 {
-    /* Play the best move available using the minimax decision tree */
-    int i;
-    if (game_over(root))
+    /* Find a move among the generated options, NO_MOVE if it is not one */
+    decision_node_t node;
+    int i, found = NO_MOVE;
+    copy_board(node.board, board);
+    pack_board(node.board, &node.packed);
+    node.move.movenum = curmove.movenum;
+    calculate_options(&node);
+    for (i = 0; i < node.options; i++)
+    {
+        if ((node.next_move[i].move.sourcecol == curmove.sourcecol) &&
+            (node.next_move[i].move.sourcerow == curmove.sourcerow) &&
+            (node.next_move[i].move.targetcol == curmove.targetcol) &&
+            (node.next_move[i].move.targetrow == curmove.targetrow) &&
+            (node.next_move[i].move.hops == curmove.hops) &&
+            (memcmp(node.next_move[i].move.hopcol, curmove.hopcol,
+                    curmove.hops) == 0) &&
+            (memcmp(node.next_move[i].move.hoprow, curmove.hoprow,
+                    curmove.hops) == 0))
+        {
+            found = i;
+            break;
+        }
+    }
+    free(node.next_move);
+    return found;
+}
+
+void finish_record(board_t board, int move, uint64_t offset,
+                   record_index_t **index, int *games, int *size)
+{
+    /* Add an index entry for the game just written, if it had any moves.
+    A game ending where the side to move has no options gets that result */
+    decision_node_t node;
+    record_index_t *grown;
+    if (move == INITIAL_MOVE + 1)
     {
-        /* We're not going to find any moves, so can return early */
-        root->move.movenum = game_over(root);
         return;
     }
-    recur_fill_costs(root, INITIAL_DEPTH);
-    propagate_cost(root);
-    for (i = 0; i < root->options; i++)
+    if (*games == *size)
+    {
+        *size *= 2;
+        grown = realloc(*index, *size * sizeof(record_index_t));
+        assert(grown);
+        *index = grown;
+    }
+    copy_board(node.board, board);
+    pack_board(node.board, &node.packed);
+    node.move.movenum = move;
+    calculate_options(&node);
+    memset(*index + *games, 0, sizeof(record_index_t));
+    (*index)[*games].offset = offset;
+    (*index)[*games].moves = move - (INITIAL_MOVE + 1);
+    if (game_over(&node) == INT_MAX)
+    {
+        (*index)[*games].result = RESULT_BLACK;
+    }
+    else if (game_over(&node) == INT_MIN)
+    {
+        (*index)[*games].result = RESULT_WHITE;
+    }
+    else
+    {
+        (*index)[*games].result = RESULT_UNKNOWN;
+    }
+    free(node.next_move);
+    (*games)++;
+}
+
+int is_record_file(char *filename)
+{
+    /* Check whether a file starts with the record magic */
+    FILE *fp = fopen(filename, "rb");
+    char magic[RECORD_MAGIC_LEN];
+    int found;
+    if (!fp)
+    {
+        return 0;
+    }
+    found = (fread(magic, 1, RECORD_MAGIC_LEN, fp) == RECORD_MAGIC_LEN) &&
+            (memcmp(magic, RECORD_MAGIC, RECORD_MAGIC_LEN) == 0);
+    fclose(fp);
+    return found;
+}
+
+int open_records(char *filename, records_t *records)
+{
+    /* Map a record file into memory and check its header and index.
+    Return 1 on success, 0 otherwise */
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    uint32_t game;
+    if ((fd < 0) || (fstat(fd, &info) != 0))
+    {
+        printf("ERROR: Cannot open record file %s.\n", filename);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+    records->size = info.st_size;
+    records->data = NULL;
+    if (records->size >= sizeof(record_header_t))
+    {
+        records->data = mmap(NULL, records->size, PROT_READ, MAP_PRIVATE,
+                             fd, 0);
+    }
+    close(fd);
+    if (!records->data || (records->data == MAP_FAILED))
+    {
+        printf("ERROR: Cannot map record file %s.\n", filename);
+        return 0;
+    }
+    records->header = (record_header_t *)records->data;
+    records->index =
+        (record_index_t *)(records->data + records->header->index_offset);
+    if ((memcmp(records->header->magic, RECORD_MAGIC, RECORD_MAGIC_LEN) !=
+         0) ||
+        (records->header->version != RECORD_VERSION) ||
+        (records->header->board_size != BOARD_SIZE) ||
+        (records->header->rules != rules) ||
+        (records->header->index_offset < sizeof(record_header_t)) ||
+        (records->header->index_offset % RECORD_ALIGN != 0) ||
+        (records->header->index_offset > records->size) ||
+        ((records->size - records->header->index_offset) /
+             sizeof(record_index_t) <
+         records->header->games))
+    {
+        printf("ERROR: %s is not a valid record file.\n", filename);
+        close_records(records);
+        return 0;
+    }
+    for (game = 0; game < records->header->games; game++)
+    {
+        /* Compared without adding, which could wrap round */
+        if ((records->index[game].offset < sizeof(record_header_t)) ||
+            (records->index[game].offset > records->header->index_offset) ||
+            (records->index[game].moves >
+             records->header->index_offset - records->index[game].offset))
+        {
+            printf("ERROR: Game %u of %s is out of range.\n", game + 1,
+                   filename);
+            close_records(records);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void close_records(records_t *records)
+{
+    munmap(records->data, records->size);
+    records->data = NULL;
+}
+
+int replay_game(records_t *records, int game, visit_position_t visit,
+                void *arg)
+{
+    /* Replay a game from its move bytes, visiting the start and every
+    position reached. Return 1 if the game replayed, 0 otherwise */
+    record_index_t *entry = records->index + game;
+    uint8_t *moves = records->data + entry->offset;
+    decision_node_t node;
+    uint32_t ply;
+    fill_board(node.board);
+    pack_board(node.board, &node.packed);
+    for (ply = 0; ply <= entry->moves; ply++)
     {
-        if ((root->next_move + i)->minimax_cost == root->minimax_cost)
+        if (!visit(node.board, INITIAL_MOVE + 1 + ply, entry->result,
+                   ply == entry->moves, arg) ||
+            (ply == entry->moves))
         {
-            *best_move = (root->next_move + i)->move;
             break;
         }
+        node.move.movenum = INITIAL_MOVE + 1 + ply;
+        calculate_options(&node);
+        if (moves[ply] >= node.options)
+        {
+            printf("ERROR: Bad move %u in game %d.\n", ply + 1, game + 1);
+            free(node.next_move);
+            return 0;
+        }
+        copy_board(node.board, node.next_move[moves[ply]].board);
+        node.packed = node.next_move[moves[ply]].packed;
+        free(node.next_move);
     }
+    return 1;
 }
 
-void recur_fill_costs(decision_node_t *root, int depth)
+/*-------------------------------------------------------------------*/
+/* POSITION INDEX FUNCTIONS */
+
+int build_index(char *input, char *output, int threads)
 {
-    /* Propagate the costs all the way up the tree from TREE_DEPTH */
-    int i;
-    /* Ensure the game isnt over */
-    if (root->options == NO_OPTIONS)
+    /* Count every position reached in a record file with the results of
+    the games reaching it. Threads first replay a share of the games each,
+    splitting positions into one buffer per thread by key range; then each
+    thread sorts and merges one key range, so the ranges written in order
+    are the whole index sorted. Return 1 on success, 0 otherwise */
+    records_t records;
+    index_header_t header;
+    index_job_t *jobs;
+    index_buffer_t *buffers;
+    pthread_t *ids;
+    char temp[MAX_LINE_LEN];
+    FILE *fp;
+    uint32_t games;
+    uint64_t positions = 0;
+    int t, ok = 1;
+    if (!open_records(input, &records))
+    {
+        return 0;
+    }
+    games = records.header->games;
+    if ((uint32_t)threads > games)
+    {
+        threads = games ? (int)games : 1;
+    }
+    /* Keys are made before the threads start, as hash_board sets them up */
+    init_keys();
+    ids = malloc(threads * sizeof(pthread_t));
+    jobs = malloc(threads * sizeof(index_job_t));
+    buffers = calloc(threads * threads, sizeof(index_buffer_t));
+    assert(ids && jobs && buffers);
+    for (t = 0; t < threads; t++)
+    {
+        jobs[t].records = &records;
+        jobs[t].first = (uint32_t)((uint64_t)games * t / threads);
+        jobs[t].last = (uint32_t)((uint64_t)games * (t + 1) / threads);
+        jobs[t].thread = t;
+        jobs[t].threads = threads;
+        jobs[t].ok = 1;
+        jobs[t].buffers = buffers;
+        pthread_create(&ids[t], NULL, index_games, &jobs[t]);
+    }
+    for (t = 0; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+        ok = ok && jobs[t].ok;
+    }
+    close_records(&records);
+    for (t = 0; t < threads; t++)
+    {
+        pthread_create(&ids[t], NULL, merge_index_part, &jobs[t]);
+    }
+    for (t = 0; t < threads; t++)
+    {
+        pthread_join(ids[t], NULL);
+        positions += jobs[t].merged.count;
+    }
+    if (ok)
+    {
+        /* Replace the file by a rename, as another run may have it mapped */
+        snprintf(temp, MAX_LINE_LEN, "%s.tmp", output);
+        ok = (fp = fopen(temp, "wb")) != NULL;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, INDEX_MAGIC, RECORD_MAGIC_LEN);
+        header.version = INDEX_VERSION;
+        header.board_size = BOARD_SIZE;
+        header.entry_size = sizeof(index_entry_t);
+        header.key_check = zobrist_black;
+        header.games = games;
+        header.positions = positions;
+        ok = ok && (fwrite(&header, sizeof(header), 1, fp) == 1);
+        for (t = 0; ok && (t < threads); t++)
+        {
+            ok = fwrite(jobs[t].merged.entries, sizeof(index_entry_t),
+                        jobs[t].merged.count,
+                        fp) == jobs[t].merged.count;
+        }
+        ok = fp && (fclose(fp) == 0) && ok && (rename(temp, output) == 0);
+        if (!ok)
+        {
+            printf("ERROR: Cannot write index %s.\n", output);
+            remove(temp);
+        }
+    }
+    if (ok)
+    {
+        printf("INDEXED %u GAMES, %llu POSITIONS\n", games,
+               (unsigned long long)positions);
+    }
+    for (t = 0; t < threads; t++)
+    {
+        free(jobs[t].merged.entries);
+    }
+    free(ids);
+    free(jobs);
+    free(buffers);
+    return ok;
+}
+
+void *index_games(void *arg)
+{
+    /* Replay one thread's share of the games into its key range buffers */
+    index_job_t *job = arg;
+    uint32_t game;
+    int part;
+    for (game = job->first; job->ok && (game < job->last); game++)
+    {
+        job->ok = replay_game(job->records, game, visit_index_position, job);
+    }
+    for (part = 0; part < job->threads; part++)
+    {
+        compact_index_buffer(job->buffers + job->thread * job->threads + part);
+    }
+    return NULL;
+}
+
+int visit_index_position(board_t board, int movenum, int result, int final,
+                         void *arg)
+{
+    /* Add one reached position to the buffer for its key range */
+    index_job_t *job = arg;
+    index_buffer_t *buffer;
+    index_entry_t *entry;
+    uint64_t key = hash_board(board, movenum);
+    /* The top bits pick the range, so lower ranges hold lower keys */
+    int part = (int)(((key >> 32) * job->threads) >> 32);
+    (void)final;
+    buffer = job->buffers + job->thread * job->threads + part;
+    if (buffer->count == buffer->size)
+    {
+        /* Merge repeats first, growing only if that freed too little, so a
+        buffer holds at most twice its distinct positions */
+        compact_index_buffer(buffer);
+        if (!buffer->size || (buffer->count * 2 > buffer->size))
+        {
+            buffer->size = buffer->size ? 2 * buffer->size : INITIAL_INDEX;
+            entry = realloc(buffer->entries,
+                            buffer->size * sizeof(index_entry_t));
+            assert(entry);
+            buffer->entries = entry;
+        }
+    }
+    entry = buffer->entries + buffer->count++;
+    memset(entry, 0, sizeof(index_entry_t));
+    entry->key = key;
+    pack_board(board, &entry->position);
+    entry->black_to_move = (movenum % CHECK_ODDEVEN == BLACK_MOVE);
+    entry->results[(result < RESULT_KINDS) ? result : RESULT_UNKNOWN] = 1;
+    return 1;
+}
+
+void *merge_index_part(void *arg)
+{
+    /* Gather one key range from every thread, sort it and add up the
+    results of repeated positions */
+    index_job_t *job = arg;
+    index_buffer_t *buffer, *merged = &job->merged;
+    size_t out = 0;
+    int t;
+    merged->count = 0;
+    for (t = 0; t < job->threads; t++)
+    {
+        merged->count += job->buffers[t * job->threads + job->thread].count;
+    }
+    merged->size = merged->count ? merged->count : 1;
+    merged->entries = malloc(merged->size * sizeof(index_entry_t));
+    assert(merged->entries);
+    for (t = 0; t < job->threads; t++)
+    {
+        buffer = job->buffers + t * job->threads + job->thread;
+        if (buffer->count)
+        {
+            memcpy(merged->entries + out, buffer->entries,
+                   buffer->count * sizeof(index_entry_t));
+            out += buffer->count;
+        }
+        free(buffer->entries);
+        buffer->entries = NULL;
+    }
+    compact_index_buffer(merged);
+    return NULL;
+}
+
+void compact_index_buffer(index_buffer_t *buffer)
+{
+    /* Sort a buffer and merge repeated positions into one entry each */
+    index_entry_t *entries = buffer->entries;
+    size_t i, out = 0;
+    int k;
+    if (!buffer->count)
     {
-        root->minimax_cost = game_over(root);
         return;
     }
-    /* At TREE_DEPTH-1 we need to find cost of all TREE_DEPTH child nodes */
-    if (depth == TREE_DEPTH - 1)
+    qsort(entries, buffer->count, sizeof(index_entry_t),
+          compare_index_entries);
+    for (i = 0; i < buffer->count; i++)
     {
-        for (i = 0; i < root->options; i++)
+        if (out && (compare_index_entries(entries + out - 1, entries + i) ==
+                    0))
         {
-            if (game_over(root->next_move + i))
+            for (k = 0; k < RESULT_KINDS; k++)
             {
-                (root->next_move + i)->minimax_cost =
-                    game_over(root->next_move + i);
-                continue;
+                entries[out - 1].results[k] += entries[i].results[k];
             }
-            (root->next_move + i)->minimax_cost =
-                calculate_cost((root->next_move + i)->board);
         }
-        propagate_cost(root);
+        else
+        {
+            entries[out++] = entries[i];
+        }
+    }
+    buffer->count = out;
+}
+
+int compare_index_entries(const void *first, const void *second)
+{
+    /* qsort order of index entries: by key, then side to move and pieces */
+    const index_entry_t *a = first, *b = second;
+    if (a->key != b->key)
+    {
+        return (a->key < b->key) ? -1 : 1;
+    }
+    if (a->black_to_move != b->black_to_move)
+    {
+        return (a->black_to_move < b->black_to_move) ? -1 : 1;
+    }
+    return memcmp(&a->position, &b->position, sizeof(packed_board_t));
+}
+
+int open_index(char *filename, position_index_t *index)
+{
+    /* Map a position index written by build_index and check its header.
+    Return 1 on success, 0 otherwise */
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &info) != 0))
+    {
+        printf("ERROR: Cannot open index %s.\n", filename);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+    index->size = info.st_size;
+    index->data = NULL;
+    if (index->size >= sizeof(index_header_t))
+    {
+        index->data = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (!index->data || (index->data == MAP_FAILED))
+    {
+        printf("ERROR: Cannot map index %s.\n", filename);
+        index->data = NULL;
+        return 0;
+    }
+    init_keys();
+    index->header = (index_header_t *)index->data;
+    index->entries = (index_entry_t *)(index->data + sizeof(index_header_t));
+    if ((memcmp(index->header->magic, INDEX_MAGIC, RECORD_MAGIC_LEN) != 0) ||
+        (index->header->version != INDEX_VERSION) ||
+        (index->header->board_size != BOARD_SIZE) ||
+        (index->header->entry_size != sizeof(index_entry_t)) ||
+        (index->header->key_check != zobrist_black) ||
+        ((index->size - sizeof(index_header_t)) / sizeof(index_entry_t) !=
+         index->header->positions))
+    {
+        printf("ERROR: %s is not a valid position index.\n", filename);
+        close_index(index);
+        return 0;
+    }
+    return 1;
+}
+
+void close_index(position_index_t *index)
+{
+    /* Unmap a position index */
+    if (index->data)
+    {
+        munmap(index->data, index->size);
+        index->data = NULL;
+    }
+}
+
+index_entry_t *index_probe(position_index_t *index, board_t board,
+                           int movenum)
+{
+    /* Binary search the index for a board with movenum to be played next.
+    Return its entry, or NULL if no indexed game reached it */
+    index_entry_t probe, *entry;
+    uint64_t low = 0, high, middle;
+    int order;
+    if (!index->data)
+    {
+        return NULL;
+    }
+    memset(&probe, 0, sizeof(probe));
+    probe.key = hash_board(board, movenum);
+    pack_board(board, &probe.position);
+    probe.black_to_move = (movenum % CHECK_ODDEVEN == BLACK_MOVE);
+    high = index->header->positions;
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        entry = index->entries + middle;
+        order = compare_index_entries(&probe, entry);
+        if (order == 0)
+        {
+            return entry;
+        }
+        else if (order < 0)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
+
+void print_index_entry(index_entry_t *entry)
+{
+    /* Print how many indexed games reached a position and how they ended */
+    uint32_t games = 0;
+    int k;
+    for (k = 0; entry && (k < RESULT_KINDS); k++)
+    {
+        games += entry->results[k];
+    }
+    printf("  GAMES %u", games);
+    if (games)
+    {
+        printf(" BLACK %u WHITE %u DRAWN %u", entry->results[RESULT_BLACK],
+               entry->results[RESULT_WHITE], entry->results[RESULT_DRAW]);
+    }
+    putchar('\n');
+}
+
+/*-------------------------------------------------------------------*/
+/* SEARCH TRACE FUNCTIONS */
+
+void trace_init(char *filename, double threshold)
+{
+    /* Start keeping search events, to be dumped to filename for every
+    move that takes longer than threshold milliseconds */
+    trace.events = malloc(TRACE_EVENTS * sizeof(trace_event_t));
+    assert(trace.events);
+    trace.next = trace.move_first = trace.move_start = 0;
+    trace.ply = trace.option = trace.flags = 0;
+    trace.threshold = threshold;
+    trace.filename = filename;
+}
+
+uint64_t trace_clock(void)
+{
+    /* Monotonic time in nanoseconds */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_S + (uint64_t)now.tv_nsec;
+}
+
+void trace_begin(void)
+{
+    /* Mark the start of a move's search */
+    if (!trace.events)
+    {
         return;
-        /* Recursively propagate costs up through the non TREE_DEPTH nodes */
     }
-    else
+    trace.move_first = trace.next;
+    trace.ply = 0;
+    trace.move_start = trace_clock();
+}
+
+void trace_event(int kind, int depth, int alpha, int beta, int value)
+{
+    /* Add an event to the ring, overwriting the oldest once it is full */
+    trace_event_t *event = trace.events + (trace.next++ & (TRACE_EVENTS - 1));
+    if (kind == TRACE_ENTER)
+    {
+        trace.ply++;
+    }
+    event->time = trace_clock() - trace.move_start;
+    event->alpha = alpha;
+    event->beta = beta;
+    event->value = value;
+    event->kind = (uint8_t)kind;
+    event->depth = (uint8_t)depth;
+    event->ply = (uint8_t)trace.ply;
+    event->flags = (kind == TRACE_EXIT) ? (uint8_t)trace.flags : 0;
+    event->option = (kind == TRACE_ENTER) ? (uint8_t)trace.option : 0;
+    if (kind == TRACE_EXIT)
+    {
+        trace.ply--;
+    }
+}
+
+void trace_end(board_t board, int movenum)
+{
+    /* Dump the events of a move's search if it took longer than the
+    threshold. The whole dump goes out in one write to a file opened for
+    appending, so match workers sharing the file do not interleave */
+    trace_header_t header;
+    uint64_t elapsed, count, first, k;
+    uint8_t *dump;
+    size_t size;
+    int fd;
+    if (!trace.events)
+    {
+        return;
+    }
+    elapsed = trace_clock() - trace.move_start;
+    if (elapsed < trace.threshold * NS_PER_MS)
+    {
+        return;
+    }
+    count = trace.next - trace.move_first;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, RECORD_MAGIC_LEN);
+    header.version = TRACE_VERSION;
+    header.board_size = BOARD_SIZE;
+    header.rules = rules;
+    header.movenum = movenum;
+    header.elapsed = elapsed;
+    header.dropped = (count > TRACE_EVENTS) ? count - TRACE_EVENTS : 0;
+    header.events = (uint32_t)(count - header.dropped);
+    memcpy(header.board, board, sizeof(header.board));
+    size = sizeof(header) + header.events * sizeof(trace_event_t);
+    dump = malloc(size);
+    assert(dump);
+    memcpy(dump, &header, sizeof(header));
+    first = trace.next - header.events;
+    for (k = 0; k < header.events; k++)
+    {
+        memcpy(dump + sizeof(header) + k * sizeof(trace_event_t),
+               trace.events + ((first + k) & (TRACE_EVENTS - 1)),
+               sizeof(trace_event_t));
+    }
+    fd = open(trace.filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if ((fd < 0) || (write(fd, dump, size) != (ssize_t)size))
+    {
+        fprintf(stderr, "WARNING: Cannot write trace %s.\n",
+                trace.filename);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(dump);
+}
+
+int trace_report(char *filename)
+{
+    /* Summarise every slow move dumped in a trace file.
+    Return 1 on success, 0 otherwise */
+    FILE *fp = fopen(filename, "rb");
+    trace_header_t header;
+    trace_event_t *events;
+    int moves = 0, ok = 1;
+    if (!fp)
+    {
+        printf("ERROR: Cannot open trace %s.\n", filename);
+        return 0;
+    }
+    while (fread(&header, sizeof(header), 1, fp) == 1)
     {
-        for (i = 0; i < root->options; i++)
+        if ((memcmp(header.magic, TRACE_MAGIC, RECORD_MAGIC_LEN) != 0) ||
+            (header.version != TRACE_VERSION) ||
+            (header.board_size != BOARD_SIZE) ||
+            (header.events > TRACE_EVENTS))
+        {
+            ok = 0;
+            break;
+        }
+        events = malloc((header.events ? header.events : 1) *
+                        sizeof(trace_event_t));
+        assert(events);
+        if (fread(events, sizeof(trace_event_t), header.events, fp) !=
+            header.events)
         {
-            recur_fill_costs(root->next_move + i, depth + 1);
+            free(events);
+            ok = 0;
+            break;
         }
-        propagate_cost(root);
+        /* Options are numbered as calculate_options made them then */
+        rules = header.rules;
+        report_trace_move(&header, events);
+        free(events);
+        moves++;
+    }
+    fclose(fp);
+    if (!ok)
+    {
+        printf("ERROR: %s is not a valid trace after %d moves.\n", filename,
+               moves);
     }
+    return ok;
 }
 
-void propagate_cost(decision_node_t *root)
+void report_trace_move(trace_header_t *header, trace_event_t *events)
 {
-    /* Return the max/min cost for the children of the current node */
-    int propagated_cost, i;
-    if (root->move.movenum % CHECK_ODDEVEN == BLACK_MOVE)
+    /* Print the root options whose subtrees took the most time, costliest
+    first, each followed by its costliest replies. A subtree counts only
+    if the ring still held the event entering it */
+    trace_stats_t *stats = calloc(MAX_OPTIONS * (MAX_OPTIONS + 1),
+                                  sizeof(trace_stats_t)),
+                  *stat, totals;
+    uint64_t start[UCHAR_MAX + 1];
+    trace_stats_t at[UCHAR_MAX + 1];
+    uint8_t path[UCHAR_MAX + 1], open[UCHAR_MAX + 1] = {0};
+    int order[MAX_OPTIONS], shown[MAX_OPTIONS + 1], first, reply, line,
+        count = 0, k, ply, best;
+    uint32_t e;
+    assert(stats);
+    memset(&totals, 0, sizeof(totals));
+    for (e = 0; e < header->events; e++)
     {
-        propagated_cost = INT_MIN;
-        /* It must be black's move, so find the max */
-        for (i = 0; i < root->options; i++)
+        ply = events[e].ply;
+        if (events[e].kind == TRACE_ENTER)
         {
-            if ((root->next_move + i)->minimax_cost > propagated_cost)
-            {
-                propagated_cost = (root->next_move + i)->minimax_cost;
-            }
+            totals.nodes++;
+            path[ply] = events[e].option;
+            open[ply] = (events[e].option < MAX_OPTIONS);
+            start[ply] = events[e].time;
+            at[ply] = totals;
+            at[ply].nodes--;
+            continue;
+        }
+        totals.hits += (events[e].flags & TRACE_TT_HIT) != 0;
+        totals.cutoffs += (events[e].flags & TRACE_CUTOFF) != 0;
+        if ((ply == 1) && open[1])
+        {
+            stat = stats + path[1] * (MAX_OPTIONS + 1);
+        }
+        else if ((ply == 2) && open[1] && open[2])
+        {
+            stat = stats + path[1] * (MAX_OPTIONS + 1) + path[2] + 1;
+        }
+        else
+        {
+            open[ply] = 0;
+            continue;
         }
+        stat->time += events[e].time - start[ply];
+        stat->nodes += totals.nodes - at[ply].nodes;
+        stat->hits += totals.hits - at[ply].hits;
+        stat->cutoffs += totals.cutoffs - at[ply].cutoffs;
+        open[ply] = 0;
     }
-    else
+    printf(MOVE_SEPERATOR);
+    printf("SLOW MOVE %u: %.1f MS, %u EVENTS, %llu DROPPED\n",
+           header->movenum, header->elapsed / NS_PER_MS, header->events,
+           (unsigned long long)header->dropped);
+    /* Insertion sort of the root options by time */
+    for (first = 0; first < MAX_OPTIONS; first++)
+    {
+        if (!stats[first * (MAX_OPTIONS + 1)].nodes)
+        {
+            continue;
+        }
+        for (k = count; (k > 0) &&
+                        (stats[order[k - 1] * (MAX_OPTIONS + 1)].time <
+                         stats[first * (MAX_OPTIONS + 1)].time);
+             k--)
+        {
+            order[k] = order[k - 1];
+        }
+        order[k] = first;
+        count++;
+    }
+    for (k = 0; k < count; k++)
     {
-        /* White's move, so find the min */
-        propagated_cost = INT_MAX;
-        for (i = 0; i < root->options; i++)
+        stat = stats + order[k] * (MAX_OPTIONS + 1);
+        printf("%5.1f%% %8.1f MS %8llu NODES %7llu HITS %7llu CUTOFFS ",
+               100.0 * stat->time / header->elapsed, stat->time / NS_PER_MS,
+               (unsigned long long)stat->nodes,
+               (unsigned long long)stat->hits,
+               (unsigned long long)stat->cutoffs);
+        print_trace_path(header, order[k], NO_MOVE);
+        memset(shown, 0, sizeof(shown));
+        for (line = 0; line < TRACE_CHILDREN; line++)
         {
-            if ((root->next_move + i)->minimax_cost < propagated_cost)
+            /* Pick the costliest reply not listed yet */
+            best = NO_MOVE;
+            for (reply = 1; reply <= MAX_OPTIONS; reply++)
+            {
+                if (!shown[reply] && stat[reply].nodes &&
+                    ((best == NO_MOVE) || (stat[reply].time > stat[best].time)))
+                {
+                    best = reply;
+                }
+            }
+            if (best == NO_MOVE)
             {
-                propagated_cost = (root->next_move + i)->minimax_cost;
+                break;
             }
+            shown[best] = 1;
+            printf("       %8.1f MS %8llu NODES %7llu HITS %7llu CUTOFFS   ",
+                   stat[best].time / NS_PER_MS,
+                   (unsigned long long)stat[best].nodes,
+                   (unsigned long long)stat[best].hits,
+                   (unsigned long long)stat[best].cutoffs);
+            print_trace_path(header, order[k], best - 1);
         }
     }
-    root->minimax_cost = propagated_cost;
+    free(stats);
+}
+
+void print_trace_path(trace_header_t *header, int first, int second)
+{
+    /* Print a root option of a dumped move, and a reply to it unless
+    second is NO_MOVE, by generating the options again */
+    decision_node_t root, reply;
+    char text[MOVE_TEXT_LEN];
+    memcpy(root.board, header->board, sizeof(root.board));
+    pack_board(root.board, &root.packed);
+    root.move.movenum = header->movenum;
+    calculate_options(&root);
+    if (first >= root.options)
+    {
+        printf("?\n");
+        free(root.next_move);
+        return;
+    }
+    printf("%s", move_text(root.next_move[first].move, text));
+    if (second != NO_MOVE)
+    {
+        copy_board(reply.board, root.next_move[first].board);
+        reply.packed = root.next_move[first].packed;
+        reply.move.movenum = header->movenum + 1;
+        calculate_options(&reply);
+        printf(" %s", (second < reply.options)
+                          ? move_text(reply.next_move[second].move, text)
+                          : "?");
+        free(reply.next_move);
+    }
+    putchar('\n');
+    free(root.next_move);
 }